@@ -0,0 +1,49 @@
+/* Optional interface of the agent reporting the state of the transport
+ * of the stream.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+/*!
+ * \file
+ * \brief Transport statistics
+ *
+ * Agents which can report how the stream is sent also implement
+ * TransportMonitor. Plugins adapting their encoding to the transport
+ * can query it with a dynamic_cast from the Agent passed to their entry
+ * point, which keeps the Agent interface unchanged for the other plugins.
+ */
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Counters of the data written to the streaming device since the agent
+ * started. They only increase, the rates are computed from differences.
+ */
+struct TransportStats
+{
+    /*! Bytes written */
+    uint64_t bytes_sent;
+    /*! Messages written */
+    uint64_t messages_sent;
+    /*! Time spent writing, including waiting for the device to accept the data, in ns */
+    uint64_t write_time;
+};
+
+class __attribute__ ((visibility ("default"))) TransportMonitor
+{
+public:
+    /*! Get the current counters. Can be called from any thread. */
+    virtual TransportStats GetTransportStats() const = 0;
+
+protected:
+    virtual ~TransportMonitor() = default;
+};
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,110 @@
+/* Adaptation of the encoder bitrate to the transport.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "bitrate-controller.hpp"
+
+#include <algorithm>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+// frames with the port congested before lowering the bitrate
+constexpr unsigned frames_to_decrease = 2;
+// frames with the port mostly idle before raising the bitrate
+constexpr unsigned frames_to_increase = 30;
+// frames ignored after a change, the time for the encoder and the
+// estimates to follow; shorter after a decrease so that a lasting
+// congestion is handled quickly
+constexpr unsigned hold_after_decrease = 4;
+constexpr unsigned hold_after_increase = 8;
+// share of the time writing to the port above which it is congested,
+// and below which it is mostly idle
+constexpr unsigned busy_high = 80;
+constexpr unsigned busy_low = 50;
+
+/* Moving average giving a weight of 1/8 to the new value */
+uint64_t smooth(uint64_t average, uint64_t value)
+{
+    if (average == 0) {
+        return value;
+    }
+    return average - average / 8 + value / 8;
+}
+
+}
+
+BitrateController::BitrateController(const Settings &settings):
+    settings(settings),
+    target(settings.max_bitrate)
+{
+}
+
+bool BitrateController::update(uint64_t now, size_t frame_size, const TransportStats &stats)
+{
+    if (last_time == 0 || now <= last_time) {
+        last_time = now;
+        last_stats = stats;
+        return false;
+    }
+
+    const uint64_t elapsed = now - last_time;
+    const uint64_t sent = stats.bytes_sent - last_stats.bytes_sent;
+    const uint64_t write_time = stats.write_time - last_stats.write_time;
+    last_time = now;
+    last_stats = stats;
+
+    if (sent > 0 && write_time > 0) {
+        port_rate = smooth(port_rate, sent * 1000000000ull / write_time);
+    }
+    busy_estimate = smooth(busy_estimate, std::min<uint64_t>(write_time * 100 / elapsed, 100));
+    if (port_rate > 0) {
+        latency_estimate = smooth(latency_estimate, frame_size * 1000000000ull / port_rate);
+    }
+
+    if (!enabled()) {
+        return false;
+    }
+    if (hold > 0) {
+        --hold;
+        return false;
+    }
+
+    const bool over = busy_estimate > busy_high || latency_estimate > settings.max_latency;
+    const bool under = busy_estimate < busy_low && latency_estimate < settings.max_latency / 2;
+    frames_over = over ? frames_over + 1 : 0;
+    frames_under = under ? frames_under + 1 : 0;
+
+    const uint64_t min_bitrate = std::min(settings.min_bitrate, settings.max_bitrate);
+    uint64_t new_target = target;
+    if (frames_over >= frames_to_decrease) {
+        // below what the port drains, so the queued data goes away
+        new_target = target / 4 * 3;
+        if (port_rate > 0) {
+            new_target = std::min(new_target, drain_rate() / 4 * 3);
+        }
+        new_target = std::max(new_target, min_bitrate);
+        hold = hold_after_decrease;
+    } else if (frames_under >= frames_to_increase) {
+        new_target = std::min(target + std::max(settings.max_bitrate / 16, uint64_t(1)),
+                              settings.max_bitrate);
+        hold = hold_after_increase;
+    } else {
+        return false;
+    }
+
+    frames_over = frames_under = 0;
+    if (new_target == target) {
+        hold = 0;
+        return false;
+    }
+    target = new_target;
+    return true;
+}
+
+}} // namespace spice::streaming_agent
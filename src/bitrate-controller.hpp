@@ -0,0 +1,94 @@
+/* Adaptation of the encoder bitrate to the transport.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <spice-streaming-agent/transport-monitor.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Closed loop controller of the target bitrate of an encoder, keeping the
+ * stream within what the port drains.
+ *
+ * The port is congested when the writes block most of the time or when
+ * writing a frame takes too long. The bitrate is then lowered at once
+ * below the rate the port drains, and further by steps while the
+ * congestion lasts, so the frames do not pile up in the queues. It is
+ * raised by small steps after the port stayed mostly idle for a while.
+ */
+class BitrateController
+{
+public:
+    struct Settings
+    {
+        /*! highest bitrate in bits per second, used at the start */
+        uint64_t max_bitrate = 0;
+        /*! lowest bitrate in bits per second */
+        uint64_t min_bitrate = 0;
+        /*! maximum time to write a frame to the port in ns */
+        uint64_t max_latency = 200000000;
+    };
+
+    explicit BitrateController(const Settings &settings);
+
+    bool enabled() const
+    {
+        return settings.max_bitrate != 0;
+    }
+
+    /*!
+     * Account for an encoded frame, possibly changing the target bitrate.
+     * \param now the current time on CLOCK_MONOTONIC, in ns
+     * \param frame_size size of the encoded frame
+     * \param stats counters of the port
+     * \return whether the bitrate changed
+     */
+    bool update(uint64_t now, size_t frame_size, const TransportStats &stats);
+
+    /*! Target bitrate in bits per second */
+    uint64_t bitrate() const
+    {
+        return target;
+    }
+    /*! Smoothed rate the port accepts data while writing, in bits per second */
+    uint64_t drain_rate() const
+    {
+        return port_rate * 8;
+    }
+    /*! Smoothed share of the time spent writing to the port, in percent */
+    unsigned busy() const
+    {
+        return busy_estimate;
+    }
+    /*! Smoothed time to write a frame to the port, in ns */
+    uint64_t latency() const
+    {
+        return latency_estimate;
+    }
+
+private:
+    const Settings settings;
+    uint64_t target;
+
+    uint64_t last_time = 0;
+    TransportStats last_stats{};
+    // bytes per second the port accepts while writing
+    uint64_t port_rate = 0;
+    unsigned busy_estimate = 0;
+    uint64_t latency_estimate = 0;
+    // consecutive frames with the port congested or mostly idle
+    unsigned frames_over = 0, frames_under = 0;
+    // frames to wait before deciding again after a change
+    unsigned hold = 0;
+};
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,49 @@
+/* Adaptation of the frame rate to the screen changes.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "change-rate.hpp"
+
+#include <algorithm>
+
+
+namespace spice {
+namespace streaming_agent {
+
+ChangeRateController::ChangeRateController(const Settings &settings):
+    settings(settings),
+    current_fps(std::max(settings.max_fps, 1u))
+{
+}
+
+bool ChangeRateController::update(unsigned changed, unsigned total)
+{
+    if (!enabled() || total == 0) {
+        return false;
+    }
+
+    const unsigned ratio = std::min(changed, total) * 1000u / total;
+    if (ratio >= estimate) {
+        estimate = ratio;
+    } else {
+        // decay with a weight of 1/8 for the new value, rounding down so
+        // that the estimate reaches 0
+        estimate = (estimate * 7 + ratio) / 8;
+    }
+
+    const unsigned full_change = std::max(settings.full_change, 1u);
+    const unsigned fps = settings.min_fps + (settings.max_fps - settings.min_fps) *
+        std::min(estimate, full_change) / full_change;
+
+    // lower the rate by steps, not at every frame of the decay
+    if (fps > current_fps || fps <= current_fps * 3 / 4 ||
+        (fps == settings.min_fps && fps != current_fps)) {
+        current_fps = fps;
+        return true;
+    }
+    return false;
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,68 @@
+/* Adaptation of the frame rate to the screen changes.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Adapts the frame rate to the share of the screen which changes from a
+ * frame to the next: the highest rate for a video or an animation, down
+ * to a floor for mostly static content.
+ *
+ * The estimate of the change follows an increase at once, so a video
+ * starting gets the full rate from the next frame, but decays slowly so
+ * that a pause in the changes does not lower the rate immediately.
+ */
+class ChangeRateController
+{
+public:
+    struct Settings
+    {
+        /*! frame rate used when the screen does not change, 0 to disable */
+        unsigned min_fps = 0;
+        /*! frame rate used when enough of the screen changes */
+        unsigned max_fps = 10;
+        /*! share of the screen changing in each frame, in per mille, for the highest rate */
+        unsigned full_change = 100;
+    };
+
+    explicit ChangeRateController(const Settings &settings);
+
+    bool enabled() const
+    {
+        return settings.min_fps > 0 && settings.min_fps < settings.max_fps;
+    }
+
+    /*!
+     * Account for a frame tick.
+     * \param changed number of tiles which changed since the previous frame,
+     * 0 when the screen did not change
+     * \param total number of tiles of the screen
+     * \return whether the frame rate changed
+     */
+    bool update(unsigned changed, unsigned total);
+
+    unsigned fps() const
+    {
+        return current_fps;
+    }
+
+    /*! Smoothed share of the screen changing in each frame, in per mille */
+    unsigned change_ratio() const
+    {
+        return estimate;
+    }
+
+private:
+    const Settings settings;
+    unsigned current_fps;
+    unsigned estimate = 0;
+};
+
+}} // namespace spice::streaming_agent
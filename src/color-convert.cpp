@@ -0,0 +1,297 @@
+/* Conversion of BGRX images to planar YCbCr.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "color-convert.hpp"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define COLOR_CONVERT_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace spice {
+namespace streaming_agent {
+
+/* JFIF conversion coefficients scaled by 2^14, in BGRX order.
+ * The luma ones sum to 2^14, the chroma ones to 0. */
+#define Y_B 1868
+#define Y_G 9617
+#define Y_R 4899
+#define CB_B 8192
+#define CB_G -5427
+#define CB_R -2765
+#define CR_B -1332
+#define CR_G -6860
+#define CR_R 8192
+
+constexpr unsigned YCbCrImage::block_size;
+
+void YCbCrImage::resize(unsigned width, unsigned height)
+{
+    this->width = width;
+    this->height = height;
+    padded_width = (width + block_size - 1) / block_size * block_size;
+    padded_height = (height + block_size - 1) / block_size * block_size;
+    y.resize(padded_width * padded_height);
+    cb.resize(padded_width * padded_height / 4);
+    cr.resize(padded_width * padded_height / 4);
+}
+
+namespace {
+
+/* Converts two lines, from pixel x to the end of the padded line. Source
+ * pixels past the width of the image replicate the last one. */
+void convert_lines_scalar(const uint8_t *line0, const uint8_t *line1, unsigned x,
+                          unsigned width, unsigned padded_width,
+                          uint8_t *y0, uint8_t *y1, uint8_t *cb, uint8_t *cr)
+{
+    for (; x < padded_width; x += 2) {
+        const uint8_t *p[4] = {
+            line0 + std::min(x, width - 1) * 4,
+            line0 + std::min(x + 1, width - 1) * 4,
+            line1 + std::min(x, width - 1) * 4,
+            line1 + std::min(x + 1, width - 1) * 4,
+        };
+        uint8_t *y[4] = { y0 + x, y0 + x + 1, y1 + x, y1 + x + 1 };
+        int b = 0, g = 0, r = 0;
+
+        for (int i = 0; i < 4; ++i) {
+            *y[i] = (Y_B * p[i][0] + Y_G * p[i][1] + Y_R * p[i][2] + (1 << 13)) >> 14;
+            b += p[i][0];
+            g += p[i][1];
+            r += p[i][2];
+        }
+        // chroma of the average of the 4 pixels, the sums are 4 times the average
+        cb[x / 2] = (CB_B * b + CB_G * g + CB_R * r + (128 << 16) + (1 << 15)) >> 16;
+        cr[x / 2] = (CR_B * b + CR_G * g + CR_R * r + (128 << 16) + (1 << 15)) >> 16;
+    }
+}
+
+unsigned convert_lines_none(const uint8_t *, const uint8_t *, unsigned,
+                            uint8_t *, uint8_t *, uint8_t *, uint8_t *)
+{
+    return 0;
+}
+
+#if COLOR_CONVERT_X86
+/* Weighted sum of the channels of 4 pixels, as 4 32 bit integers */
+__attribute__((target("sse2")))
+inline __m128i weight4_sse2(__m128i lo, __m128i hi, __m128i coef)
+{
+    // [p0 B*cb+G*cg, p0 R*cr, p1 ..., p1 ...] and same for p2, p3
+    lo = _mm_madd_epi16(lo, coef);
+    hi = _mm_madd_epi16(hi, coef);
+    __m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+                                                   _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+                                                  _MM_SHUFFLE(3, 1, 3, 1)));
+    return _mm_add_epi32(even, odd);
+}
+
+/* Luma of 8 pixels, as 8 bytes in the low half */
+__attribute__((target("sse2")))
+inline __m128i luma8_sse2(__m128i a, __m128i b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i coef = _mm_setr_epi16(Y_B, Y_G, Y_R, 0, Y_B, Y_G, Y_R, 0);
+    const __m128i round = _mm_set1_epi32(1 << 13);
+
+    __m128i ya = weight4_sse2(_mm_unpacklo_epi8(a, zero), _mm_unpackhi_epi8(a, zero), coef);
+    __m128i yb = weight4_sse2(_mm_unpacklo_epi8(b, zero), _mm_unpackhi_epi8(b, zero), coef);
+    ya = _mm_srai_epi32(_mm_add_epi32(ya, round), 14);
+    yb = _mm_srai_epi32(_mm_add_epi32(yb, round), 14);
+    __m128i y = _mm_packs_epi32(ya, yb);
+    return _mm_packus_epi16(y, y);
+}
+
+/* Sums of the channels of the 2x2 blocks of 4 pixels of two lines,
+ * as [block 0 BGRX, block 1 BGRX] 16 bit integers */
+__attribute__((target("sse2")))
+inline __m128i block_sums_sse2(__m128i a, __m128i b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+    return _mm_unpacklo_epi64(lo, hi);
+}
+
+/* Chroma of 4 blocks given their sums, as 4 bytes in the low 32 bits */
+__attribute__((target("sse2")))
+inline __m128i chroma4_sse2(__m128i sums01, __m128i sums23, __m128i coef)
+{
+    const __m128i offset = _mm_set1_epi32((128 << 16) + (1 << 15));
+    __m128i c = _mm_srai_epi32(_mm_add_epi32(weight4_sse2(sums01, sums23, coef), offset), 16);
+    c = _mm_packs_epi32(c, c);
+    return _mm_packus_epi16(c, c);
+}
+
+__attribute__((target("sse2")))
+unsigned convert_lines_sse2(const uint8_t *line0, const uint8_t *line1, unsigned width,
+                            uint8_t *y0, uint8_t *y1, uint8_t *cb, uint8_t *cr)
+{
+    const __m128i cb_coef = _mm_setr_epi16(CB_B, CB_G, CB_R, 0, CB_B, CB_G, CB_R, 0);
+    const __m128i cr_coef = _mm_setr_epi16(CR_B, CR_G, CR_R, 0, CR_B, CR_G, CR_R, 0);
+    unsigned x;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line0 + x * 4));
+        __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line0 + x * 4 + 16));
+        __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line1 + x * 4));
+        __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line1 + x * 4 + 16));
+
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(y0 + x), luma8_sse2(a0, a1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(y1 + x), luma8_sse2(b0, b1));
+
+        __m128i sums01 = block_sums_sse2(a0, b0);
+        __m128i sums23 = block_sums_sse2(a1, b1);
+        int32_t c = _mm_cvtsi128_si32(chroma4_sse2(sums01, sums23, cb_coef));
+        __builtin_memcpy(cb + x / 2, &c, 4);
+        c = _mm_cvtsi128_si32(chroma4_sse2(sums01, sums23, cr_coef));
+        __builtin_memcpy(cr + x / 2, &c, 4);
+    }
+    return x;
+}
+
+/* Weighted sum of the channels of 8 pixels, as 8 32 bit integers.
+ * lo and hi are the unpacked halves of each 128 bit lane so the result
+ * is in the pixel order. */
+__attribute__((target("avx2")))
+inline __m256i weight8_avx2(__m256i lo, __m256i hi, __m256i coef)
+{
+    lo = _mm256_madd_epi16(lo, coef);
+    hi = _mm256_madd_epi16(hi, coef);
+    __m256i even = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(lo),
+                                                         _mm256_castsi256_ps(hi),
+                                                         _MM_SHUFFLE(2, 0, 2, 0)));
+    __m256i odd = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(lo),
+                                                        _mm256_castsi256_ps(hi),
+                                                        _MM_SHUFFLE(3, 1, 3, 1)));
+    return _mm256_add_epi32(even, odd);
+}
+
+/* Pack 16 32 bit integers in pixel order to 16 bytes */
+__attribute__((target("avx2")))
+inline __m128i pack16_avx2(__m256i a, __m256i b)
+{
+    // packs works per lane: [a0-3 b0-3 | a4-7 b4-7], reorder the 64 bit blocks
+    __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm_packus_epi16(_mm256_castsi256_si128(p), _mm256_extracti128_si256(p, 1));
+}
+
+__attribute__((target("avx2")))
+inline __m128i luma16_avx2(__m256i a, __m256i b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i coef = _mm256_setr_epi16(Y_B, Y_G, Y_R, 0, Y_B, Y_G, Y_R, 0,
+                                           Y_B, Y_G, Y_R, 0, Y_B, Y_G, Y_R, 0);
+    const __m256i round = _mm256_set1_epi32(1 << 13);
+
+    __m256i ya = weight8_avx2(_mm256_unpacklo_epi8(a, zero), _mm256_unpackhi_epi8(a, zero), coef);
+    __m256i yb = weight8_avx2(_mm256_unpacklo_epi8(b, zero), _mm256_unpackhi_epi8(b, zero), coef);
+    ya = _mm256_srai_epi32(_mm256_add_epi32(ya, round), 14);
+    yb = _mm256_srai_epi32(_mm256_add_epi32(yb, round), 14);
+    return pack16_avx2(ya, yb);
+}
+
+/* Same as block_sums_sse2 on each 128 bit lane:
+ * [block 0, block 1 | block 2, block 3] */
+__attribute__((target("avx2")))
+inline __m256i block_sums_avx2(__m256i a, __m256i b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero), _mm256_unpacklo_epi8(b, zero));
+    __m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero), _mm256_unpackhi_epi8(b, zero));
+    lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+    hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+    return _mm256_unpacklo_epi64(lo, hi);
+}
+
+/* Chroma of 8 blocks given their sums, as 8 bytes in the low 64 bits */
+__attribute__((target("avx2")))
+inline __m128i chroma8_avx2(__m256i sums0123, __m256i sums4567, __m256i coef)
+{
+    const __m256i offset = _mm256_set1_epi32((128 << 16) + (1 << 15));
+    // the blocks come out as [0 1 4 5 | 2 3 6 7]
+    __m256i c = weight8_avx2(sums0123, sums4567, coef);
+    c = _mm256_permutevar8x32_epi32(c, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+    c = _mm256_srai_epi32(_mm256_add_epi32(c, offset), 16);
+    return pack16_avx2(c, c);
+}
+
+__attribute__((target("avx2")))
+unsigned convert_lines_avx2(const uint8_t *line0, const uint8_t *line1, unsigned width,
+                            uint8_t *y0, uint8_t *y1, uint8_t *cb, uint8_t *cr)
+{
+    const __m256i cb_coef = _mm256_setr_epi16(CB_B, CB_G, CB_R, 0, CB_B, CB_G, CB_R, 0,
+                                              CB_B, CB_G, CB_R, 0, CB_B, CB_G, CB_R, 0);
+    const __m256i cr_coef = _mm256_setr_epi16(CR_B, CR_G, CR_R, 0, CR_B, CR_G, CR_R, 0,
+                                              CR_B, CR_G, CR_R, 0, CR_B, CR_G, CR_R, 0);
+    unsigned x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line0 + x * 4));
+        __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line0 + x * 4 + 32));
+        __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line1 + x * 4));
+        __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line1 + x * 4 + 32));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y0 + x), luma16_avx2(a0, a1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y1 + x), luma16_avx2(b0, b1));
+
+        __m256i sums0123 = block_sums_avx2(a0, b0);
+        __m256i sums4567 = block_sums_avx2(a1, b1);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(cb + x / 2),
+                         chroma8_avx2(sums0123, sums4567, cb_coef));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(cr + x / 2),
+                         chroma8_avx2(sums0123, sums4567, cr_coef));
+    }
+    return x;
+}
+#endif
+
+typedef unsigned ConvertLinesFunc(const uint8_t *line0, const uint8_t *line1, unsigned width,
+                                  uint8_t *y0, uint8_t *y1, uint8_t *cb, uint8_t *cr);
+
+ConvertLinesFunc *select_convert_lines()
+{
+#if COLOR_CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return convert_lines_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return convert_lines_sse2;
+    }
+#endif
+    return convert_lines_none;
+}
+
+}
+
+void bgrx_to_ycbcr420(const uint8_t *src, size_t stride, YCbCrImage &dst,
+                      unsigned first_row, unsigned last_row)
+{
+    static ConvertLinesFunc *const convert_lines = select_convert_lines();
+
+    last_row = std::min(last_row, dst.padded_height);
+    for (unsigned row = first_row; row < last_row; row += 2) {
+        // the padding lines replicate the last line
+        const uint8_t *line0 = src + std::min(row, dst.height - 1) * stride;
+        const uint8_t *line1 = src + std::min(row + 1, dst.height - 1) * stride;
+        uint8_t *y0 = dst.y_row(row);
+        uint8_t *y1 = dst.y_row(row + 1);
+        uint8_t *cb = dst.cb_row(row / 2);
+        uint8_t *cr = dst.cr_row(row / 2);
+
+        unsigned x = convert_lines(line0, line1, dst.width, y0, y1, cb, cr);
+        convert_lines_scalar(line0, line1, x, dst.width, dst.padded_width, y0, y1, cb, cr);
+    }
+}
+
+}} // namespace spice::streaming_agent
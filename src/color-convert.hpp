@@ -0,0 +1,61 @@
+/* Conversion of BGRX images to planar YCbCr.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Planar YCbCr image with 4:2:0 chroma subsampling (JFIF full range).
+ *
+ * The planes are padded to whole 16x16 macroblocks (JPEG MCUs), the
+ * padding replicates the last column and row of the image.
+ */
+class YCbCrImage
+{
+public:
+    static constexpr unsigned block_size = 16;
+
+    /*! Set the image size, keeping the allocated memory when possible */
+    void resize(unsigned width, unsigned height);
+
+    unsigned width = 0, height = 0;
+    /*! Size of the luma plane, multiples of block_size */
+    unsigned padded_width = 0, padded_height = 0;
+
+    uint8_t *y_row(unsigned row)
+    {
+        return &y[row * padded_width];
+    }
+    uint8_t *cb_row(unsigned row)
+    {
+        return &cb[row * (padded_width / 2)];
+    }
+    uint8_t *cr_row(unsigned row)
+    {
+        return &cr[row * (padded_width / 2)];
+    }
+
+    std::vector<uint8_t> y, cb, cr;
+};
+
+/*!
+ * Convert the rows [first_row, last_row) of a BGRX image of the size of
+ * dst into dst, including the padding. The rows must be a multiple of 2,
+ * last_row is clipped to dst.padded_height.
+ *
+ * Uses AVX2 or SSE2 when the CPU supports them.
+ */
+void bgrx_to_ycbcr420(const uint8_t *src, size_t stride, YCbCrImage &dst,
+                      unsigned first_row = 0, unsigned last_row = ~0u);
+
+}} // namespace spice::streaming_agent
@@ -7,6 +7,7 @@
 #include <config.h>
 #include "concrete-agent.hpp"
 #include "frame-log.hpp"
+#include "stream-port.hpp"
 
 #include <algorithm>
 #include <syslog.h>
@@ -154,3 +155,16 @@ void ConcreteAgent::LogStat(const char* format, ...)
         va_end(ap);
     }
 }
+
+void ConcreteAgent::SetStreamPort(const StreamPort *port)
+{
+    stream_port = port;
+}
+
+TransportStats ConcreteAgent::GetTransportStats() const
+{
+    if (!stream_port) {
+        return TransportStats();
+    }
+    return stream_port->stats();
+}
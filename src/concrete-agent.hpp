@@ -10,11 +10,13 @@
 #include <set>
 #include <memory>
 #include <spice-streaming-agent/plugin.hpp>
+#include <spice-streaming-agent/transport-monitor.hpp>
 
 namespace spice {
 namespace streaming_agent {
 
 class FrameLog;
+class StreamPort;
 
 struct ConcreteConfigureOption: ConfigureOption
 {
@@ -25,7 +27,7 @@ struct ConcreteConfigureOption: ConfigureOption
     }
 };
 
-class ConcreteAgent final : public Agent
+class ConcreteAgent final : public Agent, public TransportMonitor
 {
 public:
     ConcreteAgent(const std::vector<ConcreteConfigureOption> &options,
@@ -36,12 +38,16 @@ public:
     FrameCapture *GetBestFrameCapture(const std::set<SpiceVideoCodecType>& codecs);
     __attribute__ ((format (printf, 2, 3)))
     void LogStat(const char* format, ...) override;
+    /*! Set the port the stream is sent to, it must outlive the captures */
+    void SetStreamPort(const StreamPort *port);
+    TransportStats GetTransportStats() const override;
 private:
     bool PluginVersionIsCompatible(unsigned pluginVersion) const;
     void LoadPlugin(const std::string &plugin_filename);
     std::vector<std::shared_ptr<Plugin>> plugins;
     std::vector<ConcreteConfigureOption> options;
     FrameLog *const logger = nullptr;
+    const StreamPort *stream_port = nullptr;
 };
 
 }} // namespace spice::streaming_agent
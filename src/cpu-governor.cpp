@@ -0,0 +1,144 @@
+/* Limitation of the CPU used by the capture and the encoding.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "cpu-governor.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+// measurements under 70% of the limit before raising the frame rate or quality
+constexpr unsigned periods_to_increase = 3;
+constexpr int quality_step = 10;
+
+uint64_t process_cpu_time()
+{
+    rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return ((uint64_t)usage.ru_utime.tv_sec + (uint64_t)usage.ru_stime.tv_sec) * 1000000000u +
+        ((uint64_t)usage.ru_utime.tv_usec + (uint64_t)usage.ru_stime.tv_usec) * 1000u;
+}
+
+}
+
+CpuGovernor::StageTimer::StageTimer(CpuGovernor &governor, Stage stage):
+    governor(governor), stage(stage), start(utils::get_time(CLOCK_THREAD_CPUTIME_ID))
+{
+}
+
+CpuGovernor::StageTimer::~StageTimer()
+{
+    governor.stage_time[stage] += utils::get_time(CLOCK_THREAD_CPUTIME_ID) - start;
+}
+
+CpuGovernor::CpuGovernor(const Settings &settings):
+    settings(settings),
+    current_fps(std::max(settings.max_fps, 1u)),
+    current_quality(settings.max_quality)
+{
+    if (this->settings.cpus == 0) {
+        this->settings.cpus = std::max(sysconf(_SC_NPROCESSORS_ONLN), 1l);
+    }
+    this->settings.max_fps = current_fps;
+    this->settings.min_quality = std::min(settings.min_quality, settings.max_quality);
+}
+
+bool CpuGovernor::update()
+{
+    if (!enabled()) {
+        return false;
+    }
+    return update(utils::get_time(CLOCK_MONOTONIC), process_cpu_time());
+}
+
+bool CpuGovernor::update(uint64_t now, uint64_t cpu_time)
+{
+    if (start_time == 0) {
+        start_time = now;
+        start_cpu_time = cpu_time;
+        return false;
+    }
+
+    const uint64_t elapsed = now - start_time;
+    if (elapsed < settings.period) {
+        return false;
+    }
+
+    last_usage = (cpu_time - start_cpu_time) * 100 / (elapsed * settings.cpus);
+    for (unsigned stage = 0; stage < STAGE_COUNT; ++stage) {
+        last_stage_usage[stage] = stage_time[stage] * 100 / elapsed;
+        stage_time[stage] = 0;
+    }
+    start_time = now;
+    start_cpu_time = cpu_time;
+
+    if (last_usage > settings.max_cpu) {
+        periods_under = 0;
+        return decrease();
+    }
+    if (last_usage < settings.max_cpu * 7 / 10) {
+        if (++periods_under >= periods_to_increase) {
+            periods_under = 0;
+            return increase();
+        }
+    } else {
+        periods_under = 0;
+    }
+    return false;
+}
+
+/* The frame rate is lowered first down to half of the maximum, the CPU
+ * used being about proportional to it, then the quality, then the frame
+ * rate again. They are raised in the reverse order. */
+bool CpuGovernor::decrease()
+{
+    const unsigned half_fps = std::max(settings.max_fps / 2, 1u);
+
+    if (current_fps > half_fps) {
+        current_fps = std::max(current_fps * 3 / 4, half_fps);
+        return true;
+    }
+    if (current_quality > settings.min_quality) {
+        current_quality = std::max(current_quality - quality_step, settings.min_quality);
+        return true;
+    }
+    if (current_fps > 1) {
+        current_fps = std::max(current_fps * 3 / 4, 1u);
+        return true;
+    }
+    return false;
+}
+
+bool CpuGovernor::increase()
+{
+    const unsigned half_fps = std::max(settings.max_fps / 2, 1u);
+
+    if (current_fps < half_fps) {
+        current_fps = std::min(current_fps + std::max(current_fps / 4, 1u), half_fps);
+        return true;
+    }
+    if (current_quality < settings.max_quality) {
+        current_quality = std::min(current_quality + quality_step, settings.max_quality);
+        return true;
+    }
+    if (current_fps < settings.max_fps) {
+        current_fps = std::min(current_fps + std::max(current_fps / 4, 1u), settings.max_fps);
+        return true;
+    }
+    return false;
+}
+
+}} // namespace spice::streaming_agent
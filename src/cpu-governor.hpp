@@ -0,0 +1,113 @@
+/* Limitation of the CPU used by the capture and the encoding.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Keeps the CPU time used by the process under a share of the CPUs of the
+ * machine, by lowering the frame rate, then the quality, and raising them
+ * again when there is headroom.
+ *
+ * The CPU time of the whole process is measured, including the encoding
+ * threads, once per measurement period. The CPU time of the stages run by
+ * the capture thread is measured too, for the logs.
+ */
+class CpuGovernor
+{
+public:
+    enum Stage {
+        CAPTURE,
+        ENCODE,
+        STAGE_COUNT
+    };
+
+    struct Settings
+    {
+        /*! maximum usage in percent of all the CPUs, 0 for no limit */
+        unsigned max_cpu = 0;
+        /*! number of CPUs, 0 to use the number of CPUs online */
+        unsigned cpus = 0;
+        unsigned max_fps = 10;
+        /*! range of the quality, the same values to not change it */
+        int max_quality = 0, min_quality = 0;
+        /*! duration of a measurement in ns */
+        uint64_t period = 1000000000u;
+    };
+
+    /*! Accounts the CPU time of the calling thread to a stage */
+    class StageTimer
+    {
+    public:
+        StageTimer(CpuGovernor &governor, Stage stage);
+        ~StageTimer();
+        StageTimer(const StageTimer &) = delete;
+        StageTimer &operator=(const StageTimer &) = delete;
+    private:
+        CpuGovernor &governor;
+        Stage stage;
+        uint64_t start;
+    };
+
+    explicit CpuGovernor(const Settings &settings);
+
+    bool enabled() const
+    {
+        return settings.max_cpu != 0;
+    }
+
+    /*!
+     * Measure the CPU usage if the measurement period elapsed, possibly
+     * changing the frame rate and the quality. To call after each frame.
+     * \return whether the frame rate or the quality changed
+     */
+    bool update();
+    /*! Same as update() with the times given, in ns */
+    bool update(uint64_t now, uint64_t cpu_time);
+
+    unsigned fps() const
+    {
+        return current_fps;
+    }
+    int quality() const
+    {
+        return current_quality;
+    }
+
+    /*! Usage during the last measurement, in percent of all the CPUs */
+    unsigned usage() const
+    {
+        return last_usage;
+    }
+    /*! Usage of a stage during the last measurement, in percent of one CPU */
+    unsigned stage_usage(Stage stage) const
+    {
+        return last_stage_usage[stage];
+    }
+
+private:
+    bool decrease();
+    bool increase();
+
+    Settings settings;
+    unsigned current_fps;
+    int current_quality;
+
+    // start of the measurement
+    uint64_t start_time = 0, start_cpu_time = 0;
+    uint64_t stage_time[STAGE_COUNT] = {};
+    unsigned last_usage = 0;
+    unsigned last_stage_usage[STAGE_COUNT] = {};
+    // consecutive measurements with headroom
+    unsigned periods_under = 0;
+};
+
+}} // namespace spice::streaming_agent
@@ -15,8 +15,7 @@
 #include <memory>
 #include <vector>
 #include <syslog.h>
-#include <unistd.h>
-#include <sys/socket.h>
+#include <sys/epoll.h>
 
 namespace spice {
 namespace streaming_agent {
@@ -50,24 +49,27 @@ public:
         return sizeof(PayloadType) + sizeof(uint32_t) * pixels.size();
     }
 
-    void write_message_body(StreamPort &stream_port,
+    void collect_body(IoVector &iov,
         uint16_t width, uint16_t height, uint16_t xhot, uint16_t yhot,
         const std::vector<uint32_t> &pixels)
     {
-        StreamMsgCursorSet msg{};
         msg.type = SPICE_CURSOR_TYPE_ALPHA;
         msg.width = width;
         msg.height = height;
         msg.hot_spot_x = xhot;
         msg.hot_spot_y = yhot;
 
-        stream_port.write(&msg, sizeof(msg));
-        stream_port.write(pixels.data(), sizeof(uint32_t) * pixels.size());
+        iov.add(&msg, sizeof(msg));
+        iov.add(pixels.data(), sizeof(uint32_t) * pixels.size());
     }
+
+private:
+    StreamMsgCursorSet msg{};
 };
 
-CursorUpdater::CursorUpdater(StreamPort *stream_port) :
+CursorUpdater::CursorUpdater(StreamPort *stream_port, EventLoop &loop) :
     stream_port(stream_port),
+    loop(loop),
     con(xcb_connect(nullptr, nullptr))
 {
     if (xcb_connection_has_error(con.get())) {
@@ -105,72 +107,120 @@ CursorUpdater::CursorUpdater(StreamPort *stream_port) :
                                    XCB_XFIXES_CURSOR_NOTIFY_MASK_DISPLAY_CURSOR);
 
     xcb_flush(con.get());
-    running_thread = std::thread(&CursorUpdater::wait_events, this);
+
+    con_fd = xcb_get_file_descriptor(con.get());
+    loop.add(con_fd, EPOLLIN, [this](uint32_t events) {
+        handle_events(events);
+    });
+    // last, so the thread does not need to be joined if something failed
+    try {
+        thread = std::thread(&CursorUpdater::send_cursors, this);
+    } catch (...) {
+        loop.remove(con_fd);
+        throw;
+    }
 }
 
-void CursorUpdater::stop_wait_thread()
+CursorUpdater::~CursorUpdater()
 {
-    if (!shutdown(xcb_get_file_descriptor(con.get()), SHUT_RDWR)) {
-        syslog(LOG_DEBUG, "Waiting cursor updater thread to be joined ...");
-    } else {
-        syslog(LOG_WARNING, "Cannot shutdown X connection fd! "
-                            "Try to join cursor updater thread ...");
-    }
-    running_thread.join();
-    syslog(LOG_DEBUG, "Cursor updater thread joined");
+    if (con_fd >= 0) {
+        loop.remove(con_fd);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+        cond.notify_one();
+    }
+    // a cursor may be waiting for room on the port, which the server
+    // may never make
+    stream_port->interrupt();
+    thread.join();
 }
 
-CursorUpdater::~CursorUpdater()
+void CursorUpdater::handle_events(uint32_t events)
 {
-    stop_wait_thread();
+    // also consume the events queued by XCB while waiting for a reply
+    while (auto event = xcb_poll_for_event(con.get())) {
+        bool is_cursor_event = event->response_type == xfixes_event_base + XCB_XFIXES_CURSOR_NOTIFY;
+        free(event);
+        if (is_cursor_event) {
+            cursor_changed();
+        }
+    }
+
+    if (xcb_connection_has_error(con.get())) {
+        syslog(LOG_ERR, "XCB connection has error in cursor updater (%d)",
+               xcb_connection_has_error(con.get()));
+        loop.remove(con_fd);
+        con_fd = -1;
+    }
 }
 
-void CursorUpdater::wait_events()
+void CursorUpdater::cursor_changed()
 {
-    unsigned long last_serial = 0;
+    xcb_xfixes_get_cursor_image_cookie_t cookie;
 
-    xcb_flush(con.get()); // flush pending first
-    while (auto event = xcb_wait_for_event(con.get())) {
-        if (event->response_type != xfixes_event_base + XCB_XFIXES_CURSOR_NOTIFY) {
-            continue;
-        }
+    cookie = xcb_xfixes_get_cursor_image(con.get());
+    xcb_xfixes_get_cursor_image_reply_uptr
+        cursor_reply(xcb_xfixes_get_cursor_image_reply(con.get(), cookie, nullptr));
 
-        xcb_xfixes_get_cursor_image_cookie_t cookie;
+    if (!cursor_reply || cursor_reply->cursor_serial == last_serial) {
+        return;
+    }
 
-        cookie = xcb_xfixes_get_cursor_image(con.get());
-        xcb_xfixes_get_cursor_image_reply_uptr
-            cursor_reply(xcb_xfixes_get_cursor_image_reply(con.get(), cookie, nullptr));
+    if (cursor_reply->width  > STREAM_MSG_CURSOR_SET_MAX_WIDTH ||
+        cursor_reply->height > STREAM_MSG_CURSOR_SET_MAX_HEIGHT) {
+        syslog(LOG_WARNING, "cursor updater: ignoring cursor: too big %ux%u",
+                 cursor_reply->width, cursor_reply->height);
+        return;
+    }
 
-        if (cursor_reply->cursor_serial == last_serial) {
-            continue;
-        }
+    last_serial = cursor_reply->cursor_serial;
 
-        if (cursor_reply->width  > STREAM_MSG_CURSOR_SET_MAX_WIDTH ||
-            cursor_reply->height > STREAM_MSG_CURSOR_SET_MAX_HEIGHT) {
-            syslog(LOG_WARNING, "cursor updater thread: ignoring cursor: too big %ux%u",
-                     cursor_reply->width, cursor_reply->height);
-            continue;
-        }
+    std::unique_ptr<Cursor> cursor(new Cursor);
+    cursor->width = cursor_reply->width;
+    cursor->height = cursor_reply->height;
+    cursor->xhot = cursor_reply->xhot;
+    cursor->yhot = cursor_reply->yhot;
 
-        last_serial = cursor_reply->cursor_serial;
+    // the X11 cursor data may be in a wrong format, copy them to an uint32_t array
+    size_t pixcount = xcb_xfixes_get_cursor_image_cursor_image_length(cursor_reply.get());
+    cursor->pixels.reserve(pixcount);
+    const uint32_t *reply_pixels = xcb_xfixes_get_cursor_image_cursor_image(cursor_reply.get());
 
-        // the X11 cursor data may be in a wrong format, copy them to an uint32_t array
-        size_t pixcount = xcb_xfixes_get_cursor_image_cursor_image_length(cursor_reply.get());
-        std::vector<uint32_t> pixels;
-        pixels.reserve(pixcount);
-        const uint32_t *reply_pixels = xcb_xfixes_get_cursor_image_cursor_image(cursor_reply.get());
+    for (size_t i = 0; i < pixcount; ++i) {
+        cursor->pixels.push_back(reply_pixels[i]);
+    }
 
-        for (size_t i = 0; i < pixcount; ++i) {
-            pixels.push_back(reply_pixels[i]);
-        }
+    // a cursor not sent yet is replaced by this one
+    std::lock_guard<std::mutex> lock(mutex);
+    pending = std::move(cursor);
+    cond.notify_one();
+}
 
-        stream_port->send<CursorMessage>(cursor_reply->width, cursor_reply->height,
-                                         cursor_reply->xhot, cursor_reply->yhot, pixels);
+void CursorUpdater::send_cursors()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        cond.wait(lock, [this] { return quit || pending; });
+        if (quit) {
+            return;
+        }
+        std::unique_ptr<Cursor> cursor = std::move(pending);
+        lock.unlock();
+
+        // do not wait for the frame being sent, if any
+        try {
+            stream_port->post<CursorMessage>(cursor->width, cursor->height,
+                                             cursor->xhot, cursor->yhot, cursor->pixels);
+        } catch (const WriteError &e) {
+            // the server is not reading the port, the next cursor will be sent anyway
+            syslog(LOG_WARNING, "cursor updater: %s", e.what());
+        } catch (const CursorError &e) {
+            syslog(LOG_WARNING, "cursor updater: %s", e.what());
+        }
+        lock.lock();
     }
-    if (xcb_connection_has_error(con.get()) != XCB_CONN_ERROR) {
-        syslog(LOG_ERR, "XCB connecnion has error in cursor updater thread (%d)",
-               xcb_connection_has_error(con.get()));
-    } // otherwise it might be a shutdown(con_fd) which initiated intentionally
 }
 
 }} // namespace spice::streaming_agent
@@ -7,11 +7,15 @@
 
 #pragma once
 
+#include "event-loop.hpp"
 #include "stream-port.hpp"
 
 #include <xcb/xfixes.h>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
 namespace spice {
 namespace streaming_agent {
@@ -28,21 +32,43 @@ namespace streaming_agent {
 DECLARE_T_UPTR(xcb_connection, xcb_disconnect)
 DECLARE_T_UPTR(xcb_xfixes_get_cursor_image_reply, free)
 
+/*!
+ * Watches the cursor changes from the thread running the event loop and
+ * sends them from a thread of its own, so the loop is not blocked while
+ * the port is full. Only the latest cursor waiting to be sent is kept.
+ * Destroying it interrupts the writes to the port, as the agent exits.
+ */
 class CursorUpdater
 {
 public:
-    CursorUpdater(StreamPort *stream_port);
+    CursorUpdater(StreamPort *stream_port, EventLoop &loop);
     ~CursorUpdater();
     CursorUpdater(const CursorUpdater &) = delete;
     CursorUpdater &operator=(const CursorUpdater &) = delete;
 private:
+    struct Cursor
+    {
+        uint16_t width, height, xhot, yhot;
+        std::vector<uint32_t> pixels;
+    };
+
     StreamPort *stream_port;
+    EventLoop &loop;
     xcb_connection_uptr con; // connection to X11
+    int con_fd;
     uint32_t xfixes_event_base;  // event number for the XFixes events
-    std::thread running_thread;
+    unsigned long last_serial = 0;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    // protected by mutex
+    std::unique_ptr<Cursor> pending;
+    bool quit = false;
+    std::thread thread;
 
-    void wait_events(); // run in sperate thread
-    void stop_wait_thread();
+    void handle_events(uint32_t events);
+    void cursor_changed();
+    void send_cursors();
 };
 
 }} // namespace spice::streaming_agent
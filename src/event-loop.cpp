@@ -0,0 +1,231 @@
+/* An epoll based event loop.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "event-loop.hpp"
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <algorithm>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+std::string error_message(const char *what)
+{
+    return std::string(what) + ": " + strerror(errno);
+}
+
+}
+
+EventLoop::EventLoop()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        throw Error(error_message("Cannot create the epoll instance"));
+    }
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        close(epoll_fd);
+        throw Error(error_message("Cannot create the eventfd"));
+    }
+    add(wake_fd, EPOLLIN, [this](uint32_t) {
+        uint64_t value;
+        if (read(wake_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+            throw Error(error_message("Cannot read the eventfd"));
+        }
+        run_posted();
+    });
+}
+
+EventLoop::~EventLoop()
+{
+    for (int timer : timers) {
+        close(timer);
+    }
+    if (signal_fd >= 0) {
+        close(signal_fd);
+    }
+    close(wake_fd);
+    close(epoll_fd);
+}
+
+void EventLoop::add(int fd, uint32_t events, const Handler &handler)
+{
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        throw Error(error_message("Cannot watch a file descriptor"));
+    }
+    handlers[fd] = std::make_shared<Handler>(handler);
+}
+
+void EventLoop::modify(int fd, uint32_t events)
+{
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        throw Error(error_message("Cannot modify a watched file descriptor"));
+    }
+}
+
+void EventLoop::remove(int fd)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    handlers.erase(fd);
+}
+
+int EventLoop::add_timer(const std::function<void()> &handler)
+{
+    int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer < 0) {
+        throw Error(error_message("Cannot create a timer"));
+    }
+    try {
+        add(timer, EPOLLIN, [timer, handler](uint32_t) {
+            uint64_t expirations;
+            if (read(timer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                handler();
+            }
+        });
+    } catch (...) {
+        close(timer);
+        throw;
+    }
+    timers.push_back(timer);
+    return timer;
+}
+
+void EventLoop::set_timer(int timer, uint64_t delay, uint64_t interval)
+{
+    itimerspec spec{};
+    spec.it_value.tv_sec = delay / 1000000000u;
+    spec.it_value.tv_nsec = delay % 1000000000u;
+    spec.it_interval.tv_sec = interval / 1000000000u;
+    spec.it_interval.tv_nsec = interval % 1000000000u;
+    if (timerfd_settime(timer, 0, &spec, nullptr) < 0) {
+        throw Error(error_message("Cannot set a timer"));
+    }
+}
+
+void EventLoop::remove_timer(int timer)
+{
+    remove(timer);
+    timers.erase(std::remove(timers.begin(), timers.end(), timer), timers.end());
+    close(timer);
+}
+
+void EventLoop::add_signals(const std::vector<int> &signals,
+                            const std::function<void(int)> &handler)
+{
+    if (signal_fd >= 0) {
+        throw Error("Signals are already handled by the loop");
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int signal : signals) {
+        sigaddset(&mask, signal);
+    }
+    if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+        throw Error("Cannot block the signals");
+    }
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signal_fd < 0) {
+        throw Error(error_message("Cannot create the signalfd"));
+    }
+    add(signal_fd, EPOLLIN, [this, handler](uint32_t) {
+        signalfd_siginfo info;
+        while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+            handler(info.ssi_signo);
+        }
+    });
+}
+
+void EventLoop::post(const std::function<void()> &task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        posted.push_back(task);
+    }
+    wake();
+}
+
+void EventLoop::quit()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quitting = true;
+    }
+    wake();
+}
+
+void EventLoop::wake()
+{
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        throw Error(error_message("Cannot write the eventfd"));
+    }
+}
+
+void EventLoop::run_posted()
+{
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.swap(posted);
+    }
+    for (auto &task : tasks) {
+        task();
+    }
+}
+
+void EventLoop::run()
+{
+    epoll_event events[16];
+
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (quitting) {
+                quitting = false;
+                return;
+            }
+        }
+
+        int count = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw Error(error_message("epoll_wait failed"));
+        }
+
+        for (int i = 0; i < count; ++i) {
+            // the handler may be removed by the previous ones
+            auto it = handlers.find(events[i].data.fd);
+            if (it == handlers.end()) {
+                continue;
+            }
+            std::shared_ptr<Handler> handler = it->second;
+            (*handler)(events[i].events);
+        }
+    }
+}
+
+}} // namespace spice::streaming_agent
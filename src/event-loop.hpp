@@ -0,0 +1,88 @@
+/* An epoll based event loop.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Dispatches the readiness of file descriptors, timers (timerfd) and
+ * signals (signalfd) to handlers, all called from the thread running
+ * the loop. Exceptions thrown by the handlers stop the loop and are
+ * propagated by run().
+ */
+class EventLoop
+{
+public:
+    /*! Called with the epoll events (EPOLLIN...) of the file descriptor */
+    typedef std::function<void(uint32_t events)> Handler;
+
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    /*! Watch a file descriptor, level triggered */
+    void add(int fd, uint32_t events, const Handler &handler);
+    /*! Change the events watched on a file descriptor */
+    void modify(int fd, uint32_t events);
+    /*! Stop watching a file descriptor, can be called from a handler */
+    void remove(int fd);
+
+    /*!
+     * Create a disarmed timer.
+     * \return an identifier of the timer for set_timer() and remove_timer()
+     */
+    int add_timer(const std::function<void()> &handler);
+    /*!
+     * Arm a timer to expire after delay, then every interval if not 0
+     * (in nanoseconds). A delay of 0 disarms the timer.
+     */
+    void set_timer(int timer, uint64_t delay, uint64_t interval = 0);
+    void remove_timer(int timer);
+
+    /*!
+     * Handle signals in the loop. The signals are blocked for the calling
+     * thread, so this should be called before starting other threads
+     * which then inherit the signal mask.
+     */
+    void add_signals(const std::vector<int> &signals, const std::function<void(int)> &handler);
+
+    /*! Call a function from the loop. Can be called from any thread. */
+    void post(const std::function<void()> &task);
+
+    /*! Dispatch the events until quit() is called */
+    void run();
+    /*! Make run() return. Can be called from any thread. */
+    void quit();
+
+private:
+    void wake();
+    void run_posted();
+
+    int epoll_fd;
+    // eventfd waking up the loop for posted tasks
+    int wake_fd;
+    int signal_fd = -1;
+    std::map<int, std::shared_ptr<Handler>> handlers;
+    std::vector<int> timers;
+
+    std::mutex mutex;
+    // protected by mutex
+    std::vector<std::function<void()>> posted;
+    bool quitting = false;
+};
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,153 @@
+/* Buffers for frame data.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "frame-buffer.hpp"
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+constexpr size_t FrameBuffer::huge_page_size;
+
+FrameBuffer::FrameBuffer(bool huge_pages):
+    huge_pages(huge_pages)
+{
+}
+
+FrameBuffer::~FrameBuffer()
+{
+    if (ptr) {
+        munmap(ptr, mapped);
+    }
+}
+
+FrameBuffer::FrameBuffer(FrameBuffer &&other) noexcept
+{
+    swap(other);
+}
+
+FrameBuffer &FrameBuffer::operator=(FrameBuffer &&other) noexcept
+{
+    swap(other);
+    return *this;
+}
+
+void FrameBuffer::swap(FrameBuffer &other) noexcept
+{
+    std::swap(ptr, other.ptr);
+    std::swap(length, other.length);
+    std::swap(mapped, other.mapped);
+    std::swap(huge_pages, other.huge_pages);
+}
+
+void FrameBuffer::reserve(size_t capacity)
+{
+    if (capacity <= mapped) {
+        return;
+    }
+
+    // grow geometrically to amortize the remappings
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    capacity = std::max(capacity, mapped + mapped / 2);
+    capacity = (capacity + page_size - 1) / page_size * page_size;
+
+    void *p;
+    if (ptr) {
+        p = mremap(ptr, mapped, capacity, MREMAP_MAYMOVE);
+    } else {
+        p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (p == MAP_FAILED) {
+        throw Error("Cannot allocate a frame buffer of " + std::to_string(capacity) +
+                    " bytes: " + strerror(errno));
+    }
+    ptr = static_cast<uint8_t *>(p);
+    mapped = capacity;
+
+#ifdef MADV_HUGEPAGE
+    if (huge_pages && mapped >= huge_page_size) {
+        // only advice, ignore failures
+        madvise(ptr, mapped, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+void FrameBuffer::append(const uint8_t *data, size_t size)
+{
+    size_t offset = length;
+    resize(length + size);
+    memcpy(ptr + offset, data, size);
+}
+
+FrameBufferPool::FrameBufferPool(bool huge_pages, unsigned max_free):
+    state(std::make_shared<State>())
+{
+    state->huge_pages = huge_pages;
+    state->max_free = max_free;
+}
+
+std::shared_ptr<FrameBuffer> FrameBufferPool::get()
+{
+    std::unique_ptr<FrameBuffer> buffer;
+    size_t estimate;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if (!state->free.empty()) {
+            buffer = std::move(state->free.back());
+            state->free.pop_back();
+        }
+        estimate = state->estimate;
+    }
+    if (!buffer) {
+        buffer.reset(new FrameBuffer(state->huge_pages));
+    }
+    buffer->clear();
+    // leave some room for frames larger than the average
+    buffer->reserve(estimate + estimate / 4);
+
+    std::weak_ptr<State> weak_state = state;
+    return std::shared_ptr<FrameBuffer>(buffer.release(), [weak_state](FrameBuffer *buffer) {
+        std::shared_ptr<State> state = weak_state.lock();
+        if (state) {
+            state->recycle(buffer);
+        } else {
+            delete buffer;
+        }
+    });
+}
+
+size_t FrameBufferPool::estimate() const
+{
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return state->estimate;
+}
+
+void FrameBufferPool::State::recycle(FrameBuffer *buffer)
+{
+    std::unique_ptr<FrameBuffer> owned(buffer);
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // exponential moving average with a weight of 1/8 for the new size
+    if (estimate == 0) {
+        estimate = buffer->size();
+    } else {
+        estimate = estimate - estimate / 8 + buffer->size() / 8;
+    }
+    if (free.size() < max_free) {
+        free.push_back(std::move(owned));
+    }
+}
+
+}} // namespace spice::streaming_agent
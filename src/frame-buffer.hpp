@@ -0,0 +1,131 @@
+/* Buffers for frame data.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Growable buffer of uninitialized memory for frame data.
+ *
+ * The memory is mapped directly from the system, so it is page aligned,
+ * and grows with mremap() which moves the pages instead of copying them.
+ * Unlike std::vector nothing is ever zero-filled by the buffer.
+ */
+class FrameBuffer
+{
+public:
+    /*! Buffers at least this large can use transparent huge pages */
+    static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+    FrameBuffer() = default;
+    /*!
+     * \param huge_pages advise the system to back the buffer with huge
+     * pages when it is large enough, useful for raw frames
+     */
+    explicit FrameBuffer(bool huge_pages);
+    ~FrameBuffer();
+    FrameBuffer(FrameBuffer &&other) noexcept;
+    FrameBuffer &operator=(FrameBuffer &&other) noexcept;
+    FrameBuffer(const FrameBuffer &) = delete;
+    FrameBuffer &operator=(const FrameBuffer &) = delete;
+
+    uint8_t *data()
+    {
+        return ptr;
+    }
+    const uint8_t *data() const
+    {
+        return ptr;
+    }
+    size_t size() const
+    {
+        return length;
+    }
+    size_t capacity() const
+    {
+        return mapped;
+    }
+    bool empty() const
+    {
+        return length == 0;
+    }
+
+    /*!
+     * Make sure the buffer can hold capacity bytes, keeping its content.
+     * Throws an Error if the memory cannot be allocated.
+     */
+    void reserve(size_t capacity);
+
+    /*! Set the size of the content, the added bytes are left uninitialized */
+    void resize(size_t size)
+    {
+        reserve(size);
+        length = size;
+    }
+
+    void clear()
+    {
+        length = 0;
+    }
+
+    void append(const uint8_t *data, size_t size);
+
+    void swap(FrameBuffer &other) noexcept;
+
+private:
+    uint8_t *ptr = nullptr;
+    size_t length = 0, mapped = 0;
+    bool huge_pages = false;
+};
+
+/*!
+ * Pool of recycled frame buffers.
+ *
+ * The buffers are handed out empty with a capacity estimated from the
+ * size of the recent buffers returned to the pool, so that they usually
+ * do not need to grow. A buffer goes back to the pool when its last
+ * reference is dropped, even if the pool was destroyed in the meantime.
+ */
+class FrameBufferPool
+{
+public:
+    /*!
+     * \param huge_pages whether the buffers use huge pages when large
+     * \param max_free number of unused buffers kept
+     */
+    explicit FrameBufferPool(bool huge_pages = false, unsigned max_free = 4);
+
+    /*! Get an empty buffer. Thread safe. */
+    std::shared_ptr<FrameBuffer> get();
+
+    /*! Moving average of the size of the buffers returned to the pool */
+    size_t estimate() const;
+
+private:
+    struct State
+    {
+        void recycle(FrameBuffer *buffer);
+
+        mutable std::mutex mutex;
+        std::vector<std::unique_ptr<FrameBuffer>> free;
+        size_t estimate = 0;
+        bool huge_pages;
+        unsigned max_free;
+    };
+
+    std::shared_ptr<State> state;
+};
+
+}} // namespace spice::streaming_agent
@@ -51,6 +51,7 @@ void FrameLog::log_stat(const char* format, ...)
 void FrameLog::log_statv(const char* format, va_list ap)
 {
     if (log_file && !log_binary) {
+        std::lock_guard<std::mutex> lock(mutex);
         fprintf(log_file, "%" PRIu64 ": ", get_time());
         vfprintf(log_file, format, ap);
         fputc('\n', log_file);
@@ -60,6 +61,7 @@ void FrameLog::log_statv(const char* format, va_list ap)
 void FrameLog::log_frame(const void* buffer, size_t buffer_size)
 {
     if (log_file) {
+        std::lock_guard<std::mutex> lock(mutex);
         if (log_binary) {
             fwrite(buffer, buffer_size, 1, log_file);
         } else if (log_frames) {
@@ -7,6 +7,7 @@
 #pragma once
 
 #include <cinttypes>
+#include <mutex>
 #include <stddef.h>
 #include <stdio.h>
 
@@ -14,6 +15,10 @@
 namespace spice {
 namespace streaming_agent {
 
+/*!
+ * Logs to a file, from any thread: the lines and the frames are written
+ * whole.
+ */
 class FrameLog {
 public:
     FrameLog(const char *log_name, bool log_binary, bool log_frames);
@@ -30,6 +35,7 @@ public:
     static uint64_t get_time();
 
 private:
+    std::mutex mutex;
     FILE *log_file = nullptr;
     bool log_binary = false;
     bool log_frames = false;
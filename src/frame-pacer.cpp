@@ -0,0 +1,76 @@
+/* Pacing of the frame captures.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "frame-pacer.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <time.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+FramePacer::FramePacer(unsigned fps):
+    period(1000000000u / std::max(fps, 1u))
+{
+}
+
+void FramePacer::set_rate(unsigned fps)
+{
+    uint64_t new_period = 1000000000u / std::max(fps, 1u);
+
+    if (deadline != 0) {
+        // a shorter interval may have passed already, in which case the
+        // frame is due now rather than late for ticks which never existed
+        deadline = std::max(deadline - period + new_period, utils::get_time());
+    }
+    period = new_period;
+}
+
+void FramePacer::wait()
+{
+    uint64_t now = utils::get_time();
+    ++counters.frames;
+
+    if (deadline == 0) {
+        deadline = now;
+    }
+
+    uint64_t tick = deadline;
+    if (now < deadline) {
+        timespec until;
+        until.tv_sec = deadline / 1000000000u;
+        until.tv_nsec = deadline % 1000000000u;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, nullptr) == EINTR) {
+        }
+        now = utils::get_time();
+    } else if (now > deadline) {
+        ++counters.late;
+        // do this frame for the last tick already passed, skipping the others
+        uint64_t missed = (now - deadline) / period;
+        counters.skipped += missed;
+        tick += missed * period;
+    }
+
+    counters.last_jitter = now - tick;
+    counters.max_jitter = std::max(counters.max_jitter, counters.last_jitter);
+    counters.total_jitter += counters.last_jitter;
+
+    deadline = tick + period;
+}
+
+void FramePacer::restart()
+{
+    uint64_t now = utils::get_time();
+
+    if (now > deadline) {
+        deadline = now + period;
+    }
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,79 @@
+/* Pacing of the frame captures.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Paces the frames on a grid of absolute deadlines at a fixed rate.
+ *
+ * The deadlines do not depend on when the previous frames were done,
+ * so the intervals do not drift. When a deadline is missed the frame
+ * is done immediately and the following ticks which are already late
+ * are skipped, instead of doing frames in a burst to catch up.
+ */
+class FramePacer
+{
+public:
+    struct Stats
+    {
+        /*! number of calls to wait() */
+        uint64_t frames = 0;
+        /*! number of frames done after their deadline */
+        uint64_t late = 0;
+        /*! number of ticks skipped because they were late too */
+        uint64_t skipped = 0;
+        /*! difference between the deadline and the time the frame started, in ns */
+        uint64_t last_jitter = 0, max_jitter = 0, total_jitter = 0;
+    };
+
+    explicit FramePacer(unsigned fps);
+
+    /*!
+     * Change the rate, moving the next deadline to one new interval after
+     * the last tick, so a higher rate takes effect immediately. The
+     * deadline is not moved before the current time.
+     */
+    void set_rate(unsigned fps);
+    /*! Interval between the deadlines, in ns */
+    uint64_t interval() const
+    {
+        return period;
+    }
+    /*! Next deadline in ns on CLOCK_MONOTONIC, 0 before the first frame */
+    uint64_t next_deadline() const
+    {
+        return deadline;
+    }
+
+    /*! Wait for the deadline of the next frame */
+    void wait();
+
+    /*!
+     * Start the grid again one interval from now if the next deadline
+     * already passed, for instance when waiting for a screen change took
+     * longer than the interval. Otherwise the grid is kept.
+     */
+    void restart();
+
+    const Stats &stats() const
+    {
+        return counters;
+    }
+
+private:
+    uint64_t period;
+    // next deadline on CLOCK_MONOTONIC, 0 before the first frame
+    uint64_t deadline = 0;
+    Stats counters;
+};
+
+}} // namespace spice::streaming_agent
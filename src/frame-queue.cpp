@@ -0,0 +1,133 @@
+/* Queue of the frames waiting to be sent.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "frame-queue.hpp"
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <thread>
+
+
+namespace spice {
+namespace streaming_agent {
+
+FrameQueue::FrameQueue(unsigned depth):
+    size(depth),
+    slots(new Slot[depth])
+{
+    if (depth == 0) {
+        throw Error("The frame queue needs at least one slot");
+    }
+}
+
+bool FrameQueue::push(QueuedFrame &&frame)
+{
+    const uint64_t pos = tail.load(std::memory_order_relaxed);
+    if (frame.droppable && pos - head.load() >= size && replace_newest(frame)) {
+        return !closed;
+    }
+
+    wait([this, pos]() {
+        return pos - head.load() < size || closed;
+    });
+    if (closed) {
+        return false;
+    }
+
+    Slot &slot = slots[pos % size];
+    slot.frame = std::move(frame);
+    slot.state = READY;
+    tail.store(pos + 1);
+    notify();
+    return true;
+}
+
+/* Replace the newest frame of a full queue, unless the consumer is
+ * already taking it or it cannot be dropped */
+bool FrameQueue::replace_newest(QueuedFrame &frame)
+{
+    Slot &slot = slots[(tail.load(std::memory_order_relaxed) - 1) % size];
+    unsigned state = READY;
+    if (!slot.state.compare_exchange_strong(state, REPLACING)) {
+        return false;
+    }
+
+    bool replaced = slot.frame.droppable;
+    if (replaced) {
+        slot.frame = std::move(frame);
+        ++drops;
+    }
+    slot.state = READY;
+    return replaced;
+}
+
+bool FrameQueue::pop(QueuedFrame &frame)
+{
+    uint64_t pos = head.load(std::memory_order_relaxed);
+    wait([this, pos]() {
+        return tail.load() != pos || closed;
+    });
+    if (closed) {
+        return false;
+    }
+
+    for (;;) {
+        Slot &slot = slots[pos % size];
+        unsigned state = READY;
+        while (!slot.state.compare_exchange_weak(state, TAKEN)) {
+            // the producer is replacing the frame, which is quick
+            state = READY;
+            std::this_thread::yield();
+        }
+
+        bool stale = slot.frame.droppable && tail.load() != pos + 1;
+        if (stale) {
+            ++drops;
+        } else {
+            frame = std::move(slot.frame);
+        }
+        // release the buffer of the slot now rather than when it is reused
+        slot.frame = QueuedFrame();
+        slot.state = EMPTY;
+        head.store(++pos);
+        notify();
+
+        if (!stale) {
+            return true;
+        }
+    }
+}
+
+void FrameQueue::close()
+{
+    closed = true;
+    std::lock_guard<std::mutex> lock(mutex);
+    cond.notify_all();
+}
+
+void FrameQueue::wait(const std::function<bool()> &ready)
+{
+    if (ready()) {
+        return;
+    }
+
+    // the other thread reads waiters after updating the indices, so either
+    // it sees the increment or ready() below sees its update
+    ++waiters;
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, ready);
+    --waiters;
+}
+
+void FrameQueue::notify()
+{
+    if (waiters) {
+        std::lock_guard<std::mutex> lock(mutex);
+        cond.notify_all();
+    }
+}
+
+}} // namespace spice::streaming_agent
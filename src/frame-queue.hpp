@@ -0,0 +1,112 @@
+/* Queue of the frames waiting to be sent.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include "frame-buffer.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+
+namespace spice {
+namespace streaming_agent {
+
+struct QueuedFrame
+{
+    std::shared_ptr<FrameBuffer> buffer;
+    unsigned width = 0, height = 0;
+    uint8_t codec = 0;
+    /*! whether a format message must be sent before the frame */
+    bool stream_start = false;
+    /*! whether the frame can be dropped when a newer one is queued */
+    bool droppable = false;
+    /*! times the capture started and the frame was queued, in us */
+    uint64_t capture_start = 0, queued = 0;
+};
+
+/*!
+ * Bounded ring of frames between a single producer and a single consumer
+ * thread.
+ *
+ * Pushing and popping are lock free when the ring is neither full nor
+ * empty, the mutex is only taken to sleep and to wake up a thread which
+ * is waiting.
+ *
+ * The latest frame wins over the droppable ones: a droppable frame is
+ * dropped instead of popped when a newer frame is queued after it, and
+ * pushing a droppable frame in a full ring replaces the newest frame if
+ * it is droppable too, instead of waiting.
+ */
+class FrameQueue
+{
+public:
+    explicit FrameQueue(unsigned depth);
+    FrameQueue(const FrameQueue &) = delete;
+    FrameQueue &operator=(const FrameQueue &) = delete;
+
+    unsigned depth() const
+    {
+        return size;
+    }
+
+    /*!
+     * Add a frame, waiting while the queue is full.
+     * \return false if the queue was closed, the frame is dropped
+     */
+    bool push(QueuedFrame &&frame);
+    /*!
+     * Take the oldest frame, waiting while the queue is empty.
+     * \return false if the queue was closed
+     */
+    bool pop(QueuedFrame &frame);
+    /*! Make all the current and future calls fail, the queued frames are dropped */
+    void close();
+
+    /*! Number of frames dropped because a newer one was queued */
+    uint64_t dropped() const
+    {
+        return drops;
+    }
+
+private:
+    enum SlotState : unsigned {
+        EMPTY,
+        READY,
+        // being taken by the consumer
+        TAKEN,
+        // the frame is being replaced by the producer
+        REPLACING,
+    };
+
+    struct Slot
+    {
+        QueuedFrame frame;
+        std::atomic<unsigned> state{EMPTY};
+    };
+
+    bool replace_newest(QueuedFrame &frame);
+    void wait(const std::function<bool()> &ready);
+    void notify();
+
+    const unsigned size;
+    std::unique_ptr<Slot[]> slots;
+    // total number of frames pushed and popped, written only by the
+    // producer and the consumer respectively
+    std::atomic<uint64_t> head{0}, tail{0};
+    std::atomic<bool> closed{false};
+    std::atomic<uint64_t> drops{0};
+    // number of threads waiting on cond
+    std::atomic<unsigned> waiters{0};
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+}} // namespace spice::streaming_agent
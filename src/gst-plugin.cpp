@@ -5,12 +5,19 @@
  */
 
 #include <config.h>
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <sstream>
 #include <exception>
 #include <stdexcept>
 #include <memory>
 #include <map>
+#include <mutex>
+#include <thread>
 #include <syslog.h>
 #include <unistd.h>
 #include <gst/gst.h>
@@ -23,8 +30,20 @@
 
 #include <spice-streaming-agent/plugin.hpp>
 #include <spice-streaming-agent/frame-capture.hpp>
+#include <spice-streaming-agent/transport-monitor.hpp>
 #include <spice-streaming-agent/x11-display-info.hpp>
 
+#include "bitrate-controller.hpp"
+#include "change-rate.hpp"
+#include "cpu-governor.hpp"
+#include "frame-pacer.hpp"
+#include "tile-diff.hpp"
+#include "utils.hpp"
+#include "x11-capture.hpp"
+#include "x11-damage.hpp"
+#include "x11-events.hpp"
+#include "xshm-buffer-pool.hpp"
+
 
 #define gst_syslog(priority, str, ...) syslog(priority, "Gstreamer plugin: " str, ## __VA_ARGS__);
 
@@ -35,6 +54,18 @@ namespace gstreamer_plugin {
 struct GstreamerEncoderSettings
 {
     int fps = 25;
+    bool damage = true;
+    /* maximum CPU usage in percent of all the CPUs, 0 for no limit */
+    unsigned cpu_limit = 0;
+    unsigned min_fps = 0;
+    /* frames captured and not returned yet, more frames improve the
+     * throughput as the capture and the encoding overlap, fewer the latency.
+     * Raised at run time if the encoder holds more frames than that */
+    unsigned pipeline_depth = 2;
+    /* range of the bitrate adapted to the port in kbit/s, no adaptation
+     * when max_bitrate is 0 */
+    unsigned max_bitrate = 0;
+    unsigned min_bitrate = 0;
     SpiceVideoCodecType codec = SPICE_VIDEO_CODEC_TYPE_VP8;
     std::string encoder;
     std::map<std::string, std::string> enc_props;
@@ -53,11 +84,125 @@ DECLARE_UPTR(GstBuffer, gst_buffer_unref)
 DECLARE_UPTR(GstCaps, gst_caps_unref)
 DECLARE_UPTR(GstSample, gst_sample_unref)
 DECLARE_UPTR(GstElement, gst_object_unref)
+DECLARE_UPTR(GstBus, gst_object_unref)
+DECLARE_UPTR(Display, XCloseDisplay)
+
+/* Setting of an encoder lowering its latency, as the defaults of most
+ * encoders favour quality over latency with lookahead and B-frames */
+struct EncoderPreset
+{
+    const char *encoder;
+    const char *property;
+    /* value of the property, nullptr for the number of CPUs, for the
+     * encoders using a single thread by default */
+    const char *value;
+};
+
+static const EncoderPreset encoder_presets[] = {
+    { "x264enc", "tune", "zerolatency" },
+    { "x264enc", "speed-preset", "veryfast" },
+    { "x264enc", "bframes", "0" },
+    { "x264enc", "rc-lookahead", "0" },
+    { "x264enc", "sync-lookahead", "0" },
+    { "x265enc", "tune", "zerolatency" },
+    { "x265enc", "speed-preset", "ultrafast" },
+    { "openh264enc", "usage-type", "screen" },
+    { "openh264enc", "complexity", "low" },
+    { "vp8enc", "deadline", "1" },
+    { "vp8enc", "cpu-used", "8" },
+    { "vp8enc", "lag-in-frames", "0" },
+    { "vp8enc", "end-usage", "cbr" },
+    { "vp8enc", "threads", nullptr },
+    { "vp9enc", "deadline", "1" },
+    { "vp9enc", "cpu-used", "8" },
+    { "vp9enc", "lag-in-frames", "0" },
+    { "vp9enc", "end-usage", "cbr" },
+    { "vp9enc", "threads", nullptr },
+    { "vp9enc", "row-mt", "true" },
+    { "jpegenc", "idct-method", "ifast" },
+    { "vaapih264enc", "max-bframes", "0" },
+    { "vaapih265enc", "max-bframes", "0" },
+    { "nvh264enc", "preset", "low-latency-hq" },
+    { "nvh264enc", "zerolatency", "true" },
+    { "nvh264enc", "bframes", "0" },
+    { "nvh265enc", "preset", "low-latency-hq" },
+    { "nvh265enc", "zerolatency", "true" },
+    { "msdkh264enc", "target-usage", "7" },
+    { "msdkh264enc", "b-frames", "0" },
+    { "msdkh264enc", "async-depth", "1" },
+    { "msdkh265enc", "target-usage", "7" },
+    { "msdkh265enc", "b-frames", "0" },
+    { "msdkh265enc", "async-depth", "1" },
+    { "msdkvp9enc", "target-usage", "7" },
+    { "msdkvp9enc", "async-depth", "1" },
+};
+
+/* Apply the presets of an encoder, the properties missing from its
+ * version being skipped */
+static void apply_encoder_presets(GstElement *encoder, const char *name)
+{
+    const std::string cpus = std::to_string(std::max(std::thread::hardware_concurrency(), 1u));
+    for (const auto &preset : encoder_presets) {
+        if (strcmp(preset.encoder, name) != 0) {
+            continue;
+        }
+        if (!g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), preset.property)) {
+            gst_syslog(LOG_DEBUG, "Preset property '%s' was not found for this encoder",
+                       preset.property);
+            continue;
+        }
+        const char *value = preset.value ? preset.value : cpus.c_str();
+        gst_syslog(LOG_DEBUG, "Setting encoder preset: '%s = %s'", preset.property, value);
+        gst_util_set_object_arg(G_OBJECT(encoder), preset.property, value);
+    }
+}
+
+/* Property of an encoder setting its target bitrate */
+struct BitrateProperty
+{
+    const char *encoder;
+    const char *name;
+    /* bits per second of a unit of the property */
+    unsigned unit;
+};
+
+static const BitrateProperty bitrate_properties[] = {
+    { "x264enc", "bitrate", 1000 },
+    { "x265enc", "bitrate", 1000 },
+    { "openh264enc", "bitrate", 1 },
+    { "vp8enc", "target-bitrate", 1 },
+    { "vp9enc", "target-bitrate", 1 },
+    { "vaapih264enc", "bitrate", 1000 },
+    { "vaapih265enc", "bitrate", 1000 },
+    { "vaapivp8enc", "bitrate", 1000 },
+    { "vaapivp9enc", "bitrate", 1000 },
+    { "nvh264enc", "bitrate", 1000 },
+    { "nvh265enc", "bitrate", 1000 },
+    { "msdkh264enc", "bitrate", 1000 },
+    { "msdkh265enc", "bitrate", 1000 },
+    { "msdkvp9enc", "bitrate", 1000 },
+};
+
+static const BitrateProperty *find_bitrate_property(GstElement *encoder)
+{
+    GstElementFactory *factory = gst_element_get_factory(encoder);
+    if (!factory) {
+        return nullptr;
+    }
+    const char *name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory));
+    for (const auto &property : bitrate_properties) {
+        if (strcmp(property.encoder, name) == 0 &&
+            g_object_class_find_property(G_OBJECT_GET_CLASS(encoder), property.name)) {
+            return &property;
+        }
+    }
+    return nullptr;
+}
 
 class GstreamerFrameCapture final : public FrameCapture
 {
 public:
-    GstreamerFrameCapture(const GstreamerEncoderSettings &settings);
+    GstreamerFrameCapture(const GstreamerEncoderSettings &settings, TransportMonitor *transport);
     ~GstreamerFrameCapture();
     FrameInfo CaptureFrame() override;
     void Reset() override;
@@ -70,11 +215,88 @@ private:
     GstElement *get_encoder_plugin(const GstreamerEncoderSettings &settings, GstCapsUPtr &sink_caps);
     GstElement *get_capture_plugin(const GstreamerEncoderSettings &settings);
     void pipeline_init(const GstreamerEncoderSettings &settings);
-    Display *const dpy;
+    static BitrateController::Settings bitrate_settings(const GstreamerEncoderSettings &settings);
+    void set_bitrate(uint64_t bitrate);
+    void adapt_bitrate(size_t frame_size);
+    const DisplayUPtr dpy;
 #if XLIB_CAPTURE
+    void capture_loop();
+    void stop_capture();
     void xlib_capture();
+    void reconfigure();
+    void restart_pipeline();
+    static GstFlowReturn on_new_sample(GstAppSink *appsink, gpointer data);
+    static void on_eos(GstAppSink *appsink, gpointer data);
+    static GstBusSyncReply on_bus_message(GstBus *bus, GstMessage *message, gpointer data);
+    void set_capture_size(unsigned width, unsigned height);
+    GstBuffer *copy_to_buffer(const XImage *image);
+    static CpuGovernor::Settings governor_settings(const GstreamerEncoderSettings &settings);
+    static ChangeRateController::Settings change_rate_settings(const GstreamerEncoderSettings &settings);
+    void govern_cpu();
+    void account_changes();
+    // the frames are captured by a separate thread, with its own
+    // connection, closed after the objects using it
+    const DisplayUPtr capture_dpy;
+    std::unique_ptr<X11Events> events;
+    std::unique_ptr<DamageMonitor> damage;
+    std::unique_ptr<X11Capture> grabber;
+    TileDiff tiles;
+    FramePacer pacer;
+    CpuGovernor governor;
+    ChangeRateController changes;
+    // caps of the captured frames, changed with the resolution
+    GstCapsUPtr capture_caps;
+    // buffers the screen is read into, if MIT-SHM can be used
+    std::unique_ptr<XShmBufferPool> pool;
+    // segments of the buffers freed, of the current pool and the previous ones
+    std::shared_ptr<XShmReleasedSegments> released_segments;
+    // maximum time to wait for a screen change before capturing anyway
+    static constexpr uint64_t idle_timeout = 1000000000u;
+    // time without any frame out of the encoder after which it is assumed
+    // to hold all the frames pushed, and the pipeline depth is raised
+    static constexpr uint64_t stall_timeout = 2000000000u;
+    // depth the pipeline is not raised above, the encoder is then stuck
+    static constexpr unsigned max_pipeline_depth = 64;
+
+    struct PushedFrame
+    {
+        uint32_t width = 0, height = 0;
+        bool stream_start = false;
+        // timestamp of the buffer, kept by the encoder on its output
+        GstClockTime pts = GST_CLOCK_TIME_NONE;
+    };
+    struct EncodedFrame: PushedFrame
+    {
+        GstSampleUPtr sample;
+    };
+    std::mutex mutex;
+    std::condition_variable cond;
+    // frames pushed to the pipeline, waiting to be encoded
+    std::deque<PushedFrame> pushed;
+    // frames encoded, waiting to be returned by CaptureFrame()
+    std::deque<EncodedFrame> encoded;
+    // frames pushed and not returned at most, starting at settings.pipeline_depth
+    unsigned pipeline_depth;
+    // the last frame encoded
+    PushedFrame last_output;
+    // a frame starting a new stream was dropped by the encoder
+    bool pending_start = false;
+    // origin of the timestamps of the pushed buffers
+    const uint64_t pts_base = utils::get_time();
+    bool quit = false, eos = false, restarting = false;
+    // an error was posted by an element of the pipeline
+    bool pipeline_error = false;
+    // time the resolution started to change, 0 when not changing
+    uint64_t reconfigure_start = 0;
+    std::exception_ptr error;
+    std::thread thread;
 #endif
-    GstElementUPtr pipeline, capture, sink;
+    GstElementUPtr pipeline, capture, encoder, sink;
+    // port statistics, if the agent provides them
+    TransportMonitor *const transport;
+    BitrateController bitrate;
+    // property of the encoder setting the bitrate, if known
+    const BitrateProperty *bitrate_property = nullptr;
     GstSampleUPtr sample;
     GstMapInfo map = {};
     uint32_t last_width = ~0u, last_height = ~0u;
@@ -83,9 +305,25 @@ private:
     GstreamerEncoderSettings settings; // will be set by plugin settings
 };
 
+/* Settings of the plugin itself, which are not gst.CODEC=ENCODER options */
+static const char *const plugin_options[] = {
+    "gst.pipeline-depth",
+    "gst.max-bitrate",
+    "gst.min-bitrate",
+};
+
+static bool is_plugin_option(const std::string &name)
+{
+    return std::find(std::begin(plugin_options), std::end(plugin_options), name) !=
+           std::end(plugin_options);
+}
+
 class GstreamerPlugin final: public Plugin
 {
 public:
+    explicit GstreamerPlugin(Agent *agent): agent(agent)
+    {
+    }
     FrameCapture *CreateCapture() override;
     unsigned Rank() override;
     void ParseOptions(const ConfigureOption *options, const std::string &codec_name,
@@ -97,6 +335,7 @@ private:
     void StoreEncodingOptions(const std::string &encoder_options);
     bool StorePluginOption(const std::string &name, const std::string &value);
     GstreamerEncoderSettings settings;
+    Agent *const agent;
 };
 
 GstElement *GstreamerFrameCapture::get_capture_plugin(const GstreamerEncoderSettings &settings)
@@ -105,6 +344,12 @@ GstElement *GstreamerFrameCapture::get_capture_plugin(const GstreamerEncoderSett
 
 #if XLIB_CAPTURE
     capture = gst_element_factory_make("appsrc", "capture");
+    if (capture) {
+        // the buffers are timestamped to match the encoded frames with them
+        g_object_set(capture,
+                     "format", GST_FORMAT_TIME,
+                     nullptr);
+    }
 #else
     capture = gst_element_factory_make("ximagesrc", "capture");
     g_object_set(capture,
@@ -170,7 +415,8 @@ GstElement *GstreamerFrameCapture::get_encoder_plugin(const GstreamerEncoderSett
     }
 
     encoder = factory ? gst_element_factory_create(factory, "encoder") : nullptr;
-    if (encoder) { // Set encoder properties
+    if (encoder) { // Set encoder properties, the user ones overriding the presets
+        apply_encoder_presets(encoder, GST_ELEMENT_NAME(factory));
         for (const auto &prop : settings.enc_props) {
             const auto &name = prop.first;
             const auto &value = prop.second;
@@ -235,6 +481,16 @@ void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settin
                  "drop", FALSE,
                  "max-buffers", 1,
                  nullptr);
+#if XLIB_CAPTURE
+    // the encoded frames are queued as soon as they are available
+    GstAppSinkCallbacks callbacks = {};
+    callbacks.eos = on_eos;
+    callbacks.new_sample = on_new_sample;
+    gst_app_sink_set_callbacks(GST_APP_SINK(sink.get()), &callbacks, this, nullptr);
+
+    GstBusUPtr bus(gst_element_get_bus(pipeline.get()));
+    gst_bus_set_sync_handler(bus.get(), on_bus_message, this, nullptr);
+#endif
 
     GstBin *bin = GST_BIN(pipeline.get());
     gst_bin_add(bin, capture);
@@ -281,16 +537,90 @@ void GstreamerFrameCapture::pipeline_init(const GstreamerEncoderSettings &settin
 
     this->sink.swap(sink);
     this->capture.swap(capture);
+    this->encoder.swap(encoder);
     this->pipeline.swap(pipeline);
+
+    if (bitrate.enabled()) {
+        bitrate_property = find_bitrate_property(this->encoder.get());
+        if (bitrate_property) {
+            set_bitrate(bitrate.bitrate());
+        } else {
+            gst_syslog(LOG_WARNING, "The bitrate of this encoder cannot be adapted");
+        }
+    }
+}
+
+BitrateController::Settings
+GstreamerFrameCapture::bitrate_settings(const GstreamerEncoderSettings &settings)
+{
+    BitrateController::Settings bitrate;
+
+    bitrate.max_bitrate = settings.max_bitrate * 1000ull;
+    bitrate.min_bitrate = (settings.min_bitrate ? settings.min_bitrate : settings.max_bitrate / 10) * 1000ull;
+    return bitrate;
 }
 
-GstreamerFrameCapture::GstreamerFrameCapture(const GstreamerEncoderSettings &settings):
-    dpy(XOpenDisplay(nullptr)),settings(settings)
+void GstreamerFrameCapture::set_bitrate(uint64_t value)
+{
+    const std::string arg = std::to_string(std::max(value / bitrate_property->unit, uint64_t(1)));
+    gst_util_set_object_arg(G_OBJECT(encoder.get()), bitrate_property->name, arg.c_str());
+}
+
+/* Adapt the bitrate of the encoder to the rate the port drains */
+void GstreamerFrameCapture::adapt_bitrate(size_t frame_size)
+{
+    if (!bitrate_property || !transport) {
+        return;
+    }
+
+    if (!bitrate.update(utils::get_time(), frame_size, transport->GetTransportStats())) {
+        return;
+    }
+
+    set_bitrate(bitrate.bitrate());
+    gst_syslog(LOG_DEBUG, "Bitrate set to %" PRIu64 " kbit/s (port drains %" PRIu64 " kbit/s, "
+               "busy %u%% of the time, frame written in %" PRIu64 " us)",
+               bitrate.bitrate() / 1000, bitrate.drain_rate() / 1000, bitrate.busy(),
+               bitrate.latency() / 1000);
+}
+
+GstreamerFrameCapture::GstreamerFrameCapture(const GstreamerEncoderSettings &settings,
+                                             TransportMonitor *transport):
+    dpy(XOpenDisplay(nullptr)),
+#if XLIB_CAPTURE
+    capture_dpy(XOpenDisplay(nullptr)),
+    pacer(settings.fps),
+    governor(governor_settings(settings)),
+    changes(change_rate_settings(settings)),
+    pipeline_depth(settings.pipeline_depth),
+#endif
+    transport(transport),
+    bitrate(bitrate_settings(settings)),
+    settings(settings)
 {
     if (!dpy) {
         throw std::runtime_error("Unable to initialize X11");
     }
+#if XLIB_CAPTURE
+    if (!capture_dpy) {
+        throw std::runtime_error("Unable to initialize X11");
+    }
+    released_segments = std::make_shared<XShmReleasedSegments>(capture_dpy.get());
+    if (settings.damage) {
+        try {
+            Window root = RootWindow(capture_dpy.get(), XDefaultScreen(capture_dpy.get()));
+            events.reset(new X11Events(capture_dpy.get()));
+            damage.reset(new DamageMonitor(*events, capture_dpy.get(), root));
+            grabber.reset(new X11Capture(capture_dpy.get()));
+        } catch (const std::exception &e) {
+            gst_syslog(LOG_WARNING, "%s, capturing continuously", e.what());
+        }
+    }
+#endif
     pipeline_init(settings);
+#if XLIB_CAPTURE
+    thread = std::thread(&GstreamerFrameCapture::capture_loop, this);
+#endif
 }
 
 void GstreamerFrameCapture::free_sample()
@@ -303,9 +633,26 @@ void GstreamerFrameCapture::free_sample()
 
 GstreamerFrameCapture::~GstreamerFrameCapture()
 {
+#if XLIB_CAPTURE
+    stop_capture();
+#endif
     free_sample();
     gst_element_set_state(pipeline.get(), GST_STATE_NULL);
-    XCloseDisplay(dpy);
+#if XLIB_CAPTURE
+    encoded.clear();
+    const FramePacer::Stats &stats = pacer.stats();
+    gst_syslog(LOG_DEBUG, "Frame pacing: %" PRIu64 " frames, %" PRIu64 " late, %" PRIu64 " ticks "
+               "skipped, jitter %" PRIu64 " us on average, %" PRIu64 " us at most",
+               stats.frames, stats.late, stats.skipped,
+               stats.total_jitter / std::max(stats.frames, uint64_t(1)) / 1000,
+               stats.max_jitter / 1000);
+    pool.reset();
+    // the pipeline stopped so all the buffers were freed
+    released_segments->collect();
+    grabber.reset();
+    damage.reset();
+    events.reset();
+#endif
 }
 
 void GstreamerFrameCapture::Reset()
@@ -314,58 +661,391 @@ void GstreamerFrameCapture::Reset()
 }
 
 #if XLIB_CAPTURE
+CpuGovernor::Settings GstreamerFrameCapture::governor_settings(const GstreamerEncoderSettings &settings)
+{
+    CpuGovernor::Settings governor;
+
+    // only the frame rate is adapted, the quality settings depend on the encoder
+    governor.max_cpu = settings.cpu_limit;
+    governor.max_fps = settings.fps;
+    return governor;
+}
+
+void GstreamerFrameCapture::govern_cpu()
+{
+    if (!governor.update()) {
+        return;
+    }
+
+    pacer.set_rate(std::min(governor.fps(), changes.fps()));
+    gst_syslog(LOG_DEBUG, "CPU usage %u%% (capture %u%% of a CPU), limited to %u fps",
+               governor.usage(), governor.stage_usage(CpuGovernor::CAPTURE), governor.fps());
+}
+
+ChangeRateController::Settings
+GstreamerFrameCapture::change_rate_settings(const GstreamerEncoderSettings &settings)
+{
+    ChangeRateController::Settings changes;
+
+    changes.min_fps = settings.min_fps;
+    changes.max_fps = settings.fps;
+    return changes;
+}
+
+/* Adapt the capture rate to the share of the screen which changed */
+void GstreamerFrameCapture::account_changes()
+{
+    if (!changes.update(tiles.count(), tiles.columns() * tiles.rows())) {
+        return;
+    }
+
+    pacer.set_rate(std::min(governor.fps(), changes.fps()));
+    gst_syslog(LOG_DEBUG, "Screen change %u.%u%% per frame, capturing at %u fps",
+               changes.change_ratio() / 10, changes.change_ratio() % 10,
+               std::min(governor.fps(), changes.fps()));
+}
+
 void free_ximage(gpointer data)
 {
     XImage *image = (XImage*)data;
     image->f.destroy_image(image);
 }
 
+/* Set the caps of the frames, and the pool of buffers, for a new resolution */
+void GstreamerFrameCapture::set_capture_size(unsigned width, unsigned height)
+{
+    capture_caps.reset(gst_caps_new_simple("video/x-raw",
+                                           "format", G_TYPE_STRING, "BGRx",
+                                           "width", G_TYPE_INT, width,
+                                           "height", G_TYPE_INT, height,
+                                           "framerate", GST_TYPE_FRACTION, settings.fps, 1,
+                                           nullptr));
+    gst_app_src_set_caps(GST_APP_SRC(capture.get()), capture_caps.get());
+
+    pool.reset();
+    try {
+        pool.reset(new XShmBufferPool(capture_dpy.get(), released_segments, capture_caps.get(),
+                                      width, height));
+    } catch (const std::exception &e) {
+        gst_syslog(LOG_WARNING, "%s, allocating a buffer for each frame", e.what());
+    }
+}
+
+/* Copy an image to a new buffer, from the pool if possible */
+GstBuffer *GstreamerFrameCapture::copy_to_buffer(const XImage *image)
+{
+    const size_t size = image->height * image->bytes_per_line;
+    GstBuffer *buf;
+    if (pool) {
+        XImage *pool_image;
+        buf = pool->acquire(pool_image);
+    } else {
+        buf = gst_buffer_new_allocate(nullptr, size, nullptr);
+        if (!buf) {
+            throw std::runtime_error("Failed to allocate gstreamer buffer");
+        }
+    }
+    gst_buffer_fill(buf, 0, image->data, size);
+    return buf;
+}
+
+/* Capture the frames at the pace set, as long as fewer than pipeline_depth
+ * frames are waiting to be encoded or returned */
+void GstreamerFrameCapture::capture_loop()
+{
+    try {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                auto timeout = std::chrono::nanoseconds(uint64_t(stall_timeout));
+                bool ready = cond.wait_for(lock, timeout, [this] {
+                    return quit || pipeline_error ||
+                        pushed.size() + encoded.size() < pipeline_depth;
+                });
+                if (!ready) {
+                    if (!encoded.empty()) {
+                        // waiting for CaptureFrame() to take the frames
+                        continue;
+                    }
+                    // the encoder holds all the frames pushed, with a
+                    // lookahead for instance, and needs more to output one
+                    if (pipeline_depth >= max_pipeline_depth) {
+                        throw std::runtime_error("The GStreamer encoder returns no frame");
+                    }
+                    pipeline_depth = std::min(pipeline_depth * 2, unsigned(max_pipeline_depth));
+                    gst_syslog(LOG_WARNING, "The encoder holds %zu frames, raising the "
+                               "pipeline depth to %u", pushed.size(), pipeline_depth);
+                }
+                if (quit) {
+                    return;
+                }
+                if (pipeline_error) {
+                    if (!reconfigure_start) {
+                        // reported to CaptureFrame() by the handler below
+                        throw std::runtime_error("The GStreamer pipeline failed");
+                    }
+                    pipeline_error = false;
+                    lock.unlock();
+                    gst_syslog(LOG_WARNING, "Cannot change the resolution in place, "
+                               "restarting the pipeline");
+                    restart_pipeline();
+                    continue;
+                }
+            }
+            xlib_capture();
+            govern_cpu();
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        error = std::current_exception();
+        cond.notify_all();
+    }
+}
+
+void GstreamerFrameCapture::stop_capture()
+{
+    if (!thread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+        cond.notify_all();
+    }
+    thread.join();
+}
+
+GstFlowReturn GstreamerFrameCapture::on_new_sample(GstAppSink *appsink, gpointer data)
+{
+    GstreamerFrameCapture *self = static_cast<GstreamerFrameCapture *>(data);
+
+    GstSampleUPtr sample(gst_app_sink_pull_sample(appsink));
+    if (!sample) {
+        return GST_FLOW_OK;
+    }
+
+    GstBuffer *buffer = gst_sample_get_buffer(sample.get());
+    const GstClockTime pts = buffer ? GST_BUFFER_PTS(buffer) : GST_CLOCK_TIME_NONE;
+    const GstClockTime dts = buffer ? GST_BUFFER_DTS(buffer) : GST_CLOCK_TIME_NONE;
+    // the frames presented before the one decoded now were already output,
+    // or were dropped by the encoder
+    const GstClockTime done = GST_CLOCK_TIME_IS_VALID(dts) ? dts : pts;
+
+    std::lock_guard<std::mutex> lock(self->mutex);
+    // the encoders may drop, hold back or reorder frames, so the pushed
+    // frame is found by its timestamp
+    bool found = false;
+    PushedFrame pushed_frame = self->last_output;
+    pushed_frame.stream_start = false;
+    for (auto it = self->pushed.begin(); it != self->pushed.end();) {
+        if (GST_CLOCK_TIME_IS_VALID(pts) && it->pts == pts) {
+            pushed_frame = *it;
+            found = true;
+            it = self->pushed.erase(it);
+        } else if (GST_CLOCK_TIME_IS_VALID(done) && it->pts < done) {
+            self->pending_start = self->pending_start || it->stream_start;
+            it = self->pushed.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (!found && !self->pushed.empty()) {
+        // the encoder does not keep the timestamps, assume it outputs
+        // the frames in the order they were pushed
+        pushed_frame = self->pushed.front();
+        self->pushed.pop_front();
+    }
+
+    EncodedFrame frame;
+    static_cast<PushedFrame &>(frame) = pushed_frame;
+    // the size actually encoded, whichever frame this is
+    GstCaps *caps = gst_sample_get_caps(sample.get());
+    GstStructure *structure = caps ? gst_caps_get_structure(caps, 0) : nullptr;
+    int width, height;
+    if (structure && gst_structure_get_int(structure, "width", &width) &&
+        gst_structure_get_int(structure, "height", &height)) {
+        frame.width = width;
+        frame.height = height;
+    }
+    frame.stream_start = frame.stream_start || self->pending_start ||
+        frame.width != self->last_output.width || frame.height != self->last_output.height;
+    self->pending_start = false;
+    self->last_output = frame;
+    if (frame.stream_start && self->reconfigure_start) {
+        gst_syslog(LOG_DEBUG, "Resolution changed to %ux%u in %" PRIu64 " ms", frame.width,
+                   frame.height, (utils::get_time() - self->reconfigure_start) / 1000000);
+        self->reconfigure_start = 0;
+    }
+    frame.sample = std::move(sample);
+    self->encoded.push_back(std::move(frame));
+    self->cond.notify_all();
+    return GST_FLOW_OK;
+}
+
+void GstreamerFrameCapture::on_eos(GstAppSink *appsink, gpointer data)
+{
+    GstreamerFrameCapture *self = static_cast<GstreamerFrameCapture *>(data);
+
+    std::lock_guard<std::mutex> lock(self->mutex);
+    // the pipeline is restarted on resolution changes
+    if (!self->restarting) {
+        self->eos = true;
+        self->cond.notify_all();
+    }
+}
+
+GstBusSyncReply GstreamerFrameCapture::on_bus_message(GstBus *bus, GstMessage *message,
+                                                      gpointer data)
+{
+    GstreamerFrameCapture *self = static_cast<GstreamerFrameCapture *>(data);
+
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_ERROR) {
+        GError *err = nullptr;
+        gst_message_parse_error(message, &err, nullptr);
+        gst_syslog(LOG_WARNING, "Error from %s: %s", GST_OBJECT_NAME(GST_MESSAGE_SRC(message)),
+                   err ? err->message : "unknown");
+        g_clear_error(&err);
+
+        std::lock_guard<std::mutex> lock(self->mutex);
+        self->pipeline_error = true;
+        self->cond.notify_all();
+    }
+    return GST_BUS_PASS;
+}
+
+/* Change the resolution of the frames without stopping the pipeline, the
+ * converter and the encoder are reconfigured by the new caps */
+void GstreamerFrameCapture::reconfigure()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reconfigure_start = utils::get_time();
+    }
+    set_capture_size(cur_width, cur_height);
+
+    // the frames of the new size must not depend on the previous ones
+    GstEvent *event = gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM,
+                                           gst_structure_new("GstForceKeyUnit",
+                                                             "running-time", GST_TYPE_CLOCK_TIME,
+                                                             GST_CLOCK_TIME_NONE,
+                                                             "all-headers", G_TYPE_BOOLEAN, TRUE,
+                                                             "count", G_TYPE_UINT, 0,
+                                                             nullptr));
+    gst_element_send_event(sink.get(), event);
+}
+
+/* Stop and start the pipeline again, dropping the frames it holds */
+void GstreamerFrameCapture::restart_pipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        restarting = true;
+    }
+    gst_app_src_end_of_stream(GST_APP_SRC(capture.get()));
+    gst_element_set_state(pipeline.get(), GST_STATE_NULL);//maybe ximagesrc needs eos as well
+    {
+        // the frames still in the pipeline were dropped
+        std::lock_guard<std::mutex> lock(mutex);
+        pushed.clear();
+        restarting = false;
+        pipeline_error = false;
+    }
+    // the next frame starts a new stream
+    is_first = true;
+    gst_element_set_state(pipeline.get(), GST_STATE_PLAYING);
+}
+
 void GstreamerFrameCapture::xlib_capture()
 {
-    int screen = XDefaultScreen(dpy);
+    // the encoder would take the frames as fast as they are captured
+    pacer.wait();
+
+    if (damage && !is_first) {
+        // wait for the screen to change, if it does not capture anyway
+        // once in a while to keep the stream alive
+        damage->wait(idle_timeout);
+        pacer.restart();
+    }
 
-    Window win = RootWindow(dpy, screen);
+    CpuGovernor::StageTimer timer(governor, CpuGovernor::CAPTURE);
+    // a failed read would otherwise exit the process
+    XErrorTrap trap(capture_dpy.get());
+
+    int screen = XDefaultScreen(capture_dpy.get());
+
+    Window win = RootWindow(capture_dpy.get(), screen);
     XWindowAttributes win_info;
-    XGetWindowAttributes(dpy, win, &win_info);
+    XGetWindowAttributes(capture_dpy.get(), win, &win_info);
 
     /* Some encoders cannot handle odd resolution make sure it's even number of pixels */
     cur_width = win_info.width - win_info.width % 2;
     cur_height =  win_info.height - win_info.height % 2;
 
     if (cur_width != last_width || cur_height != last_height) {
+        const bool started = last_width != ~0u;
         last_width = cur_width;
         last_height = cur_height;
         is_first = true;
 
-        gst_app_src_end_of_stream(GST_APP_SRC(capture.get()));
-        gst_element_set_state(pipeline.get(), GST_STATE_NULL);//maybe ximagesrc needs eos as well
-        gst_element_set_state(pipeline.get(), GST_STATE_PLAYING);
+        if (started) {
+            reconfigure();
+        } else {
+            set_capture_size(cur_width, cur_height);
+        }
     }
+    released_segments->collect();
+
+    GstBufferUPtr buf;
+    if (damage) {
+        // read only the damaged areas into the shadow copy of the screen,
+        // the encoder may keep the buffer so give it a copy
+        XImage *image = grabber->update(win, cur_width, cur_height, damage->take_damage(), tiles);
+        account_changes();
+        buf.reset(copy_to_buffer(image));
+    } else {
+        if (pool) {
+            // read the screen directly into a buffer of the pool
+            XImage *image;
+            buf.reset(pool->acquire(image));
+            if (!XShmGetImage(capture_dpy.get(), win, image, 0, 0, AllPlanes)) {
+                gst_syslog(LOG_WARNING, "XShmGetImage failed, allocating a buffer for each frame");
+                buf.reset();
+                pool.reset();
+            }
+        }
 
-    XImage *image = XGetImage(dpy, win, 0, 0,
-                              cur_width, cur_height, AllPlanes, ZPixmap);
-    if (!image) {
-        throw std::runtime_error("Cannot capture from X");
-    }
+        if (!buf) {
+            XImage *image = XGetImage(capture_dpy.get(), win, 0, 0,
+                                      cur_width, cur_height, AllPlanes, ZPixmap);
+            if (!image) {
+                throw std::runtime_error("Cannot capture from X");
+            }
 
-    GstBufferUPtr buf(gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_PHYSICALLY_CONTIGUOUS, image->data,
+            buf.reset(gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_PHYSICALLY_CONTIGUOUS, image->data,
                                                   image->height * image->bytes_per_line, 0,
                                                   image->height * image->bytes_per_line, image,
                                                   free_ximage));
-    if (!buf) {
-        throw std::runtime_error("Failed to wrap image in gstreamer buffer");
+            if (!buf) {
+                throw std::runtime_error("Failed to wrap image in gstreamer buffer");
+            }
+        }
     }
 
-    GstCapsUPtr caps(gst_caps_new_simple("video/x-raw",
-                                         "format", G_TYPE_STRING, "BGRx",
-                                         "width", G_TYPE_INT, image->width,
-                                         "height", G_TYPE_INT, image->height,
-                                         "framerate", GST_TYPE_FRACTION, settings.fps, 1,
-                                         nullptr));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        PushedFrame frame;
+        frame.width = cur_width;
+        frame.height = cur_height;
+        frame.stream_start = is_first;
+        frame.pts = utils::get_time() - pts_base;
+        GST_BUFFER_PTS(buf.get()) = frame.pts;
+        pushed.push_back(frame);
+    }
+    is_first = false;
 
-    // Push sample (gst_app_src_push_sample does not take buffer ownership)
-    GstSampleUPtr appsrc_sample(gst_sample_new(buf.get(), caps.get(), nullptr, nullptr));
-    if (gst_app_src_push_sample(GST_APP_SRC(capture.get()), appsrc_sample.get()) != GST_FLOW_OK) {
+    // the caps were set on the appsrc with the resolution,
+    // gst_app_src_push_buffer takes the buffer ownership
+    if (gst_app_src_push_buffer(GST_APP_SRC(capture.get()), buf.release()) != GST_FLOW_OK) {
         throw std::runtime_error("gstramer appsrc element cannot push sample");
     }
 }
@@ -378,8 +1058,28 @@ FrameInfo GstreamerFrameCapture::CaptureFrame()
     free_sample(); // free prev if exist
 
 #if XLIB_CAPTURE
-    xlib_capture();
-#endif
+    // take the oldest frame encoded, the encoded frames depend on the
+    // previous ones so none can be skipped
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] { return !encoded.empty() || error || eos; });
+        if (encoded.empty()) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            throw std::runtime_error("No sample- EOS or state change");
+        }
+
+        EncodedFrame &frame = encoded.front();
+        sample = std::move(frame.sample);
+        info.size.width = frame.width;
+        info.size.height = frame.height;
+        info.stream_start = frame.stream_start;
+        encoded.pop_front();
+        // a frame can be captured
+        cond.notify_all();
+    }
+#else
     info.size.width = cur_width;
     info.size.height = cur_height;
     info.stream_start = is_first;
@@ -389,6 +1089,7 @@ FrameInfo GstreamerFrameCapture::CaptureFrame()
 
     // Pull sample
     sample.reset(gst_app_sink_pull_sample(GST_APP_SINK(sink.get()))); // blocking
+#endif
 
     if (sample) { // map after pipeline
         if (!gst_buffer_map(gst_sample_get_buffer(sample.get()), &map, GST_MAP_READ)) {
@@ -402,23 +1103,25 @@ FrameInfo GstreamerFrameCapture::CaptureFrame()
         throw std::runtime_error("No sample- EOS or state change");
     }
 
+    adapt_bitrate(info.buffer_size);
+
     return info;
 }
 
 std::vector<DeviceDisplayInfo> GstreamerFrameCapture::get_device_display_info() const
 {
     try {
-        return get_device_display_info_drm(dpy);
+        return get_device_display_info_drm(dpy.get());
     } catch (const std::exception &e) {
         syslog(LOG_WARNING, "Failed to get device info using DRM: %s. Using no-DRM fallback.",
                e.what());
-        return get_device_display_info_no_drm(dpy);
+        return get_device_display_info_no_drm(dpy.get());
     }
 }
 
 FrameCapture *GstreamerPlugin::CreateCapture()
 {
-    return new GstreamerFrameCapture(settings);
+    return new GstreamerFrameCapture(settings, dynamic_cast<TransportMonitor *>(agent));
 }
 
 unsigned GstreamerPlugin::Rank()
@@ -436,6 +1139,81 @@ bool GstreamerPlugin::StorePluginOption(const std::string &name, const std::stri
         } catch (const std::exception &e) {
             throw std::runtime_error("Invalid value '" + value + "' for option 'framerate'.");
         }
+    } else if (name == "damage") {
+        if (value == "on") {
+            settings.damage = true;
+        } else if (value == "off") {
+            settings.damage = false;
+        } else {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'damage'.");
+        }
+        return true;
+    } else if (name == "min-framerate") {
+        int fps;
+        try {
+            fps = std::stoi(value);
+        } catch (const std::exception &e) {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'min-framerate'.");
+        }
+        if (fps < 0) {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'min-framerate'.");
+        }
+        settings.min_fps = fps;
+        return true;
+    } else if (name == "gst.pipeline-depth") {
+        int depth;
+        try {
+            depth = std::stoi(value);
+        } catch (const std::exception &e) {
+            throw std::runtime_error("Invalid value '" + value +
+                                     "' for option 'gst.pipeline-depth'.");
+        }
+        if (depth < 1) {
+            throw std::runtime_error("Invalid value '" + value +
+                                     "' for option 'gst.pipeline-depth'.");
+        }
+        settings.pipeline_depth = depth;
+        return true;
+    } else if (name == "gst.max-bitrate") {
+        int rate;
+        try {
+            rate = std::stoi(value);
+        } catch (const std::exception &e) {
+            throw std::runtime_error("Invalid value '" + value +
+                                     "' for option 'gst.max-bitrate'.");
+        }
+        if (rate < 0) {
+            throw std::runtime_error("Invalid value '" + value +
+                                     "' for option 'gst.max-bitrate'.");
+        }
+        settings.max_bitrate = rate;
+        return true;
+    } else if (name == "gst.min-bitrate") {
+        int rate;
+        try {
+            rate = std::stoi(value);
+        } catch (const std::exception &e) {
+            throw std::runtime_error("Invalid value '" + value +
+                                     "' for option 'gst.min-bitrate'.");
+        }
+        if (rate < 0) {
+            throw std::runtime_error("Invalid value '" + value +
+                                     "' for option 'gst.min-bitrate'.");
+        }
+        settings.min_bitrate = rate;
+        return true;
+    } else if (name == "cpu-limit") {
+        int limit;
+        try {
+            limit = std::stoi(value);
+        } catch (const std::exception &e) {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'cpu-limit'.");
+        }
+        if (limit < 0 || limit > 100) {
+            throw std::runtime_error("Invalid value '" + value + "' for option 'cpu-limit'.");
+        }
+        settings.cpu_limit = limit;
+        return true;
     }
 
     return false;
@@ -532,8 +1310,8 @@ SPICE_STREAMING_AGENT_PLUGIN(agent)
         const std::string name = options->name;
         const std::string value = options->value;
 
-        if (name.rfind(gst_prefix, 0) == 0) {
-            auto plugin = std::make_shared<GstreamerPlugin>();
+        if (name.rfind(gst_prefix, 0) == 0 && !is_plugin_option(name)) {
+            auto plugin = std::make_shared<GstreamerPlugin>(agent);
             const std::string codec_name = name.substr(gst_prefix.length());
 
             plugin->ParseOptions(agent->Options(), codec_name, value);
@@ -543,7 +1321,7 @@ SPICE_STREAMING_AGENT_PLUGIN(agent)
     }
 
     if (!registered) {
-        auto plugin = std::make_shared<GstreamerPlugin>();
+        auto plugin = std::make_shared<GstreamerPlugin>(agent);
         plugin->ParseOptions(agent->Options(), "vp8", "auto");
         agent->Register(plugin);
     }
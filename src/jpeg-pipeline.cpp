@@ -0,0 +1,180 @@
+/* Encoding of several JPEG frames at the same time.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "jpeg-pipeline.hpp"
+#include "jpeg.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/* A frame in flight, with the thread encoding it */
+class JpegPipeline::Slot
+{
+public:
+    Slot():
+        thread(&Slot::run, this)
+    {
+    }
+
+    ~Slot()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+
+    void start(int quality)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->quality = quality;
+            busy = true;
+        }
+        cond.notify_all();
+    }
+
+    /* Wait for the encoding to complete, rethrowing its error if any */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        cond.wait(lock, [this] { return !busy; });
+        if (error) {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    YCbCrImage image;
+    std::shared_ptr<FrameBuffer> jpeg;
+    FrameInfo info;
+    bool repeat = false;
+    uint64_t submit_time = 0, encode_time = 0;
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;) {
+            cond.wait(lock, [this] { return busy || quit; });
+            if (quit) {
+                return;
+            }
+            lock.unlock();
+
+            uint64_t start = utils::get_time();
+            try {
+                encoder.encode(*jpeg, quality, image);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            encode_time = utils::get_time() - start;
+
+            lock.lock();
+            busy = false;
+            cond.notify_all();
+        }
+    }
+
+    JpegEncoder encoder;
+    std::mutex mutex;
+    std::condition_variable cond;
+    int quality = 0;
+    bool busy = false, quit = false;
+    std::exception_ptr error;
+    // last so that it starts after the other members are initialized
+    std::thread thread;
+};
+
+JpegPipeline::JpegPipeline(unsigned depth, FrameBufferPool &pool):
+    pool(pool)
+{
+    for (unsigned i = 0; i < std::max(depth, 1u); ++i) {
+        slots.emplace_back(new Slot);
+    }
+}
+
+JpegPipeline::~JpegPipeline()
+{
+}
+
+YCbCrImage &JpegPipeline::next_image()
+{
+    return slots[(first + pending) % slots.size()]->image;
+}
+
+void JpegPipeline::submit(int quality, const FrameInfo &info)
+{
+    Slot &slot = *slots[(first + pending) % slots.size()];
+
+    slot.info = info;
+    slot.repeat = false;
+    slot.jpeg = pool.get();
+    slot.submit_time = utils::get_time();
+    slot.start(quality);
+    ++pending;
+}
+
+void JpegPipeline::submit_repeat(const FrameInfo &info)
+{
+    Slot &slot = *slots[(first + pending) % slots.size()];
+
+    slot.info = info;
+    slot.repeat = true;
+    slot.submit_time = utils::get_time();
+    slot.encode_time = 0;
+    ++pending;
+}
+
+FrameInfo JpegPipeline::take(std::shared_ptr<FrameBuffer> &buffer, Timings &timings)
+{
+    Slot &slot = *slots[first];
+
+    first = (first + 1) % slots.size();
+    --pending;
+
+    if (!slot.repeat) {
+        slot.wait();
+        buffer = std::move(slot.jpeg);
+    }
+
+    timings.encode = slot.encode_time;
+    timings.total = utils::get_time() - slot.submit_time;
+
+    FrameInfo info = slot.info;
+    info.buffer = buffer->data();
+    info.buffer_size = buffer->size();
+    return info;
+}
+
+void JpegPipeline::clear()
+{
+    for (; pending > 0; --pending) {
+        Slot &slot = *slots[first];
+        first = (first + 1) % slots.size();
+        if (!slot.repeat) {
+            try {
+                slot.wait();
+                slot.jpeg.reset();
+            } catch (const std::exception &) {
+                // the frame is dropped anyway
+            }
+        }
+    }
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,97 @@
+/* Encoding of several JPEG frames at the same time.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include "color-convert.hpp"
+#include "frame-buffer.hpp"
+
+#include <spice-streaming-agent/frame-capture.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Pipeline of frames encoded in parallel, each on its own thread, and
+ * released in the order they were submitted.
+ *
+ * Frames are submitted already converted to YCbCr so the capture
+ * buffers can be reused as soon as submit() returns.
+ */
+class JpegPipeline
+{
+public:
+    /*!
+     * \param depth maximum number of frames in flight
+     * \param pool pool providing the buffers of the encoded frames
+     */
+    JpegPipeline(unsigned depth, FrameBufferPool &pool);
+    ~JpegPipeline();
+    JpegPipeline(const JpegPipeline &) = delete;
+    JpegPipeline &operator=(const JpegPipeline &) = delete;
+
+    bool full() const
+    {
+        return pending == slots.size();
+    }
+    bool empty() const
+    {
+        return pending == 0;
+    }
+
+    /*!
+     * Image of the next frame to submit, to fill before calling submit().
+     * The pipeline must not be full.
+     */
+    YCbCrImage &next_image();
+
+    /*!
+     * Start encoding the image returned by next_image().
+     * \param info information of the frame returned by take(), the
+     * buffer fields are ignored
+     */
+    void submit(int quality, const FrameInfo &info);
+
+    /*!
+     * Submit a frame repeating the previous one, without encoding.
+     */
+    void submit_repeat(const FrameInfo &info);
+
+    /*! Timings of a frame released by take(), in nanoseconds */
+    struct Timings
+    {
+        // time spent encoding the frame
+        uint64_t encode;
+        // time between the submission and the release of the frame
+        uint64_t total;
+    };
+
+    /*!
+     * Wait for the oldest frame to be encoded and release it.
+     * buffer is set to the encoded data, it is left unchanged for
+     * repeated frames. The pipeline must not be empty.
+     * Throws an Error if the encoding failed.
+     */
+    FrameInfo take(std::shared_ptr<FrameBuffer> &buffer, Timings &timings);
+
+    /*! Wait for all the frames in flight and drop them */
+    void clear();
+
+private:
+    class Slot;
+
+    FrameBufferPool &pool;
+    std::vector<std::unique_ptr<Slot>> slots;
+    // index of the oldest frame and number of frames in flight
+    unsigned first = 0, pending = 0;
+};
+
+}} // namespace spice::streaming_agent
@@ -4,88 +4,123 @@
  * Copyright 2017 Red Hat Inc. All rights reserved.
  */
 #include <config.h>
-#include <stdio.h>
-#include <stdint.h>
-#include <ctype.h>
-#include <jpeglib.h>
-#include <setjmp.h>
-
 #include "jpeg.hpp"
 
-struct JpegBuffer: public jpeg_destination_mgr
+#include <spice-streaming-agent/error.hpp>
+
+#include <algorithm>
+#include <string>
+
+
+namespace spice {
+namespace streaming_agent {
+
+void JpegEncoder::error_exit(j_common_ptr cinfo)
 {
-    JpegBuffer(std::vector<uint8_t>& buffer);
-    ~JpegBuffer();
+    ErrorManager *err = static_cast<ErrorManager *>(cinfo->err);
+    longjmp(err->jump_buffer, 1);
+}
 
-    std::vector<uint8_t>& buffer;
-};
+void JpegEncoder::init_destination(j_compress_ptr cinfo)
+{
+    Destination *dest = static_cast<Destination *>(cinfo->dest);
+    FrameBuffer &buffer = *dest->buffer;
 
-static boolean buf_empty_output_buffer(j_compress_ptr cinfo)
+    // use all the memory already allocated, the buffer is not initialized
+    buffer.resize(std::max(buffer.capacity(), size_t(32 * 1024)));
+    dest->next_output_byte = buffer.data();
+    dest->free_in_buffer = buffer.size();
+}
+
+boolean JpegEncoder::empty_output_buffer(j_compress_ptr cinfo)
 {
-    JpegBuffer *buf = (JpegBuffer *) cinfo->dest;
-    size_t size = buf->buffer.size();
-    buf->buffer.resize(buf->buffer.capacity() * 2);
-    buf->next_output_byte = &buf->buffer[0] + size;
-    buf->free_in_buffer = buf->buffer.size() - size;
+    Destination *dest = static_cast<Destination *>(cinfo->dest);
+    FrameBuffer &buffer = *dest->buffer;
+
+    // libjpeg requires the whole buffer to be consumed when calling this
+    size_t size = buffer.size();
+    buffer.resize(size * 2);
+    dest->next_output_byte = buffer.data() + size;
+    dest->free_in_buffer = buffer.size() - size;
     return TRUE;
 }
 
-static void dummy_destination(j_compress_ptr cinfo)
+void JpegEncoder::term_destination(j_compress_ptr cinfo)
 {
+    Destination *dest = static_cast<Destination *>(cinfo->dest);
+    FrameBuffer &buffer = *dest->buffer;
+
+    buffer.resize(dest->next_output_byte - buffer.data());
 }
 
-JpegBuffer::JpegBuffer(std::vector<uint8_t>& buffer):
-    buffer(buffer)
+JpegEncoder::JpegEncoder()
 {
-    if (buffer.capacity() < 32 * 1024) {
-        buffer.resize(32 * 1024);
-    } else {
-        buffer.resize(buffer.capacity());
-    }
-    next_output_byte = &buffer[0];
-    free_in_buffer = buffer.size();
-    init_destination = dummy_destination;
-    empty_output_buffer = buf_empty_output_buffer;
-    term_destination = dummy_destination;
+    cinfo.err = jpeg_std_error(&jerr);
+    jerr.error_exit = error_exit;
+    jpeg_create_compress(&cinfo);
+
+    dest.init_destination = init_destination;
+    dest.empty_output_buffer = empty_output_buffer;
+    dest.term_destination = term_destination;
+    cinfo.dest = &dest;
+
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(&cinfo);
+    // the defaults are 2x2 sampling for Y and 1x1 for Cb and Cr, i.e. 4:2:0
+    cinfo.raw_data_in = TRUE;
 }
 
-JpegBuffer::~JpegBuffer()
+JpegEncoder::~JpegEncoder()
 {
-    buffer.resize(next_output_byte - &buffer[0]);
+    jpeg_destroy_compress(&cinfo);
 }
 
-/* from https://github.com/LuaDist/libjpeg/blob/master/example.c */
-void write_JPEG_file(std::vector<uint8_t>& buffer, int quality, uint8_t *data, unsigned width, unsigned height)
+void JpegEncoder::encode(FrameBuffer &buffer, int quality,
+                         const uint8_t *data, unsigned width, unsigned height, size_t stride)
 {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    int row_stride;
+    image.resize(width, height);
+    bgrx_to_ycbcr420(data, stride, image);
+    encode(buffer, quality, image);
+}
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
+void JpegEncoder::encode(FrameBuffer &buffer, int quality, YCbCrImage &image,
+                         unsigned first_row, unsigned height)
+{
+    if (setjmp(jerr.jump_buffer)) {
+        char message[JMSG_LENGTH_MAX];
+        (*cinfo.err->format_message)(reinterpret_cast<j_common_ptr>(&cinfo), message);
+        // return the compressor to its idle state so it can be reused
+        jpeg_abort_compress(&cinfo);
+        throw Error(std::string("JPEG encoding failed: ") + message);
+    }
 
-    JpegBuffer buf(buffer);
-    cinfo.dest = &buf;
+    dest.buffer = &buffer;
 
-    cinfo.image_width = width;
+    if (quality != this->quality) {
+        jpeg_set_quality(&cinfo, quality, TRUE);
+        this->quality = quality;
+    }
+
+    cinfo.image_width = image.width;
     cinfo.image_height = height;
-    cinfo.input_components = 4;
-    cinfo.in_color_space = JCS_EXT_BGRX;
-    jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
 
     jpeg_start_compress(&cinfo, TRUE);
 
-    row_stride = width * 4;
-
+    // jpeg_write_raw_data takes exactly one iMCU row, 16 luma lines
+    JSAMPARRAY planes[3] = { y_rows, cb_rows, cr_rows };
     while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = &data[cinfo.next_scanline * row_stride];
-        // TODO check error
-        (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+        unsigned row = first_row + cinfo.next_scanline;
+        for (unsigned i = 0; i < DCTSIZE; ++i) {
+            y_rows[2 * i] = image.y_row(row + 2 * i);
+            y_rows[2 * i + 1] = image.y_row(row + 2 * i + 1);
+            cb_rows[i] = image.cb_row(row / 2 + i);
+            cr_rows[i] = image.cr_row(row / 2 + i);
+        }
+        jpeg_write_raw_data(&cinfo, planes, 2 * DCTSIZE);
     }
 
     jpeg_finish_compress(&cinfo);
-
-    jpeg_destroy_compress(&cinfo);
 }
+
+}} // namespace spice::streaming_agent
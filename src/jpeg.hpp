@@ -7,6 +7,82 @@
 #pragma once
 
 #include <stdio.h>
-#include <vector>
+#include <stdint.h>
+#include <setjmp.h>
+#include <jpeglib.h>
 
-void write_JPEG_file(std::vector<uint8_t>& buffer, int quality, uint8_t *data, unsigned width, unsigned height);
+#include "color-convert.hpp"
+#include "frame-buffer.hpp"
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * JPEG encoder of 32 bit BGRX images.
+ *
+ * The libjpeg compressor, with its quantization and Huffman tables and
+ * its destination manager, is created once and reused for all the frames.
+ * The images are converted to YCbCr 4:2:0 by bgrx_to_ycbcr420() and
+ * passed to libjpeg as raw data, skipping its own color conversion and
+ * downsampling.
+ */
+class JpegEncoder
+{
+public:
+    JpegEncoder();
+    ~JpegEncoder();
+    JpegEncoder(const JpegEncoder &) = delete;
+    JpegEncoder &operator=(const JpegEncoder &) = delete;
+
+    /*!
+     * Encode an image, replacing the content of buffer with the JPEG data.
+     * Throws an Error if the encoding fails.
+     */
+    void encode(FrameBuffer &buffer, int quality,
+                const uint8_t *data, unsigned width, unsigned height, size_t stride);
+
+    /*!
+     * Encode an image already converted to YCbCr.
+     * Throws an Error if the encoding fails.
+     */
+    void encode(FrameBuffer &buffer, int quality, YCbCrImage &image)
+    {
+        encode(buffer, quality, image, 0, image.height);
+    }
+
+    /*!
+     * Encode the rows [first_row, first_row + height) of an image already
+     * converted to YCbCr as a separate JPEG image. first_row must be a
+     * multiple of YCbCrImage::block_size.
+     * Throws an Error if the encoding fails.
+     */
+    void encode(FrameBuffer &buffer, int quality, YCbCrImage &image,
+                unsigned first_row, unsigned height);
+
+private:
+    struct ErrorManager: public jpeg_error_mgr
+    {
+        jmp_buf jump_buffer;
+    };
+
+    struct Destination: public jpeg_destination_mgr
+    {
+        FrameBuffer *buffer = nullptr;
+    };
+
+    static void error_exit(j_common_ptr cinfo);
+    static void init_destination(j_compress_ptr cinfo);
+    static boolean empty_output_buffer(j_compress_ptr cinfo);
+    static void term_destination(j_compress_ptr cinfo);
+
+    jpeg_compress_struct cinfo;
+    ErrorManager jerr;
+    Destination dest;
+    int quality = -1;
+    YCbCrImage image;
+    // row pointers of one iMCU row of each plane
+    JSAMPROW y_rows[2 * DCTSIZE], cb_rows[DCTSIZE], cr_rows[DCTSIZE];
+};
+
+}} // namespace spice::streaming_agent
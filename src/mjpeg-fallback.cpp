@@ -7,33 +7,39 @@
 #include <config.h>
 #include "mjpeg-fallback.hpp"
 
-#include "jpeg.hpp"
+#include "change-rate.hpp"
+#include "cpu-governor.hpp"
+#include "frame-pacer.hpp"
+#include "jpeg-pipeline.hpp"
+#include "parallel-jpeg.hpp"
+#include "quality-controller.hpp"
+#include "tile-diff.hpp"
+#include "utils.hpp"
+#include "x11-capture.hpp"
+#include "x11-damage.hpp"
+#include "x11-events.hpp"
+#include "x11-input.hpp"
+#include <spice-streaming-agent/transport-monitor.hpp>
 #include <spice-streaming-agent/x11-display-info.hpp>
 
+#include <algorithm>
+#include <cinttypes>
 #include <cstring>
 #include <exception>
 #include <stdexcept>
 #include <sstream>
 #include <memory>
+#include <thread>
 #include <syslog.h>
 
 using namespace spice::streaming_agent;
 
-static inline uint64_t get_time()
-{
-    timespec now;
-
-    clock_gettime(CLOCK_MONOTONIC, &now);
-
-    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
-}
-
 namespace {
 
 class MjpegFrameCapture final: public FrameCapture
 {
 public:
-    MjpegFrameCapture(const MjpegSettings &settings);
+    MjpegFrameCapture(const MjpegSettings &settings, Agent *agent);
     ~MjpegFrameCapture();
     FrameInfo CaptureFrame() override;
     void Reset() override;
@@ -42,101 +48,430 @@ public:
     }
     std::vector<DeviceDisplayInfo> get_device_display_info() const override;
 private:
+    XImage *next_image(bool &is_first);
+    void wait_tick();
+    void update_rate();
+    void account_changes(unsigned changed);
+    FrameInfo last_frame_info();
+    FrameInfo encoded_frame();
+    FrameInfo pipelined_frame();
+    void adapt_quality(size_t frame_size);
+    void govern_cpu();
+    int quality() const;
+
     MjpegSettings settings;
+    Agent *const agent;
     Display *const dpy;
-
-    std::vector<uint8_t> frame;
+    X11Events events;
+    std::unique_ptr<X11Capture> grabber;
+    std::unique_ptr<DamageMonitor> damage;
+    std::unique_ptr<InputMonitor> input;
+
+    ParallelJpegEncoder encoder;
+    FrameBufferPool buffers;
+    // frames in flight, when settings.pipeline_depth > 1
+    std::unique_ptr<JpegPipeline> pipeline;
+    // last frame returned
+    std::shared_ptr<FrameBuffer> frame;
+    // whether a frame was encoded since the last reset
+    bool have_frame = false;
+    // previously grabbed image, still valid thanks to X11Capture double
+    // buffering (when not using damage)
+    XImage *prev_image = nullptr;
+    TileDiff tiles;
+    FramePacer pacer;
+    QualityController controller;
+    CpuGovernor governor;
+    ChangeRateController changes;
+    // port statistics, if the agent provides them
+    TransportMonitor *const transport;
 
     // last frame sizes
     int last_width = -1, last_height = -1;
-    // last time before capture
-    uint64_t last_time = 0;
+    // last time a frame was returned
+    uint64_t last_sent = 0;
+    // frame rate the pacer is set to
+    unsigned rate;
 };
 
 }
 
-MjpegFrameCapture::MjpegFrameCapture(const MjpegSettings& settings):
-    settings(settings),dpy(XOpenDisplay(nullptr))
+static QualityController::Settings controller_settings(const MjpegSettings &settings)
+{
+    QualityController::Settings controller;
+
+    controller.max_quality = settings.quality;
+    controller.min_quality = std::min(settings.min_quality, settings.quality);
+    controller.max_fps = settings.fps;
+    controller.adapt_fps = settings.adaptive_fps;
+    controller.target_bitrate = settings.target_bitrate * 1000ull;
+    controller.max_latency = settings.max_latency * 1000000ull;
+    return controller;
+}
+
+static CpuGovernor::Settings governor_settings(const MjpegSettings &settings)
+{
+    CpuGovernor::Settings governor;
+
+    governor.max_cpu = settings.cpu_limit;
+    governor.max_fps = settings.fps;
+    governor.max_quality = settings.quality;
+    governor.min_quality = std::min(settings.min_quality, settings.quality);
+    return governor;
+}
+
+static ChangeRateController::Settings change_rate_settings(const MjpegSettings &settings)
+{
+    ChangeRateController::Settings changes;
+
+    changes.min_fps = settings.min_fps;
+    changes.max_fps = settings.fps;
+    return changes;
+}
+
+static unsigned encoding_threads(const MjpegSettings &settings)
+{
+    // with several frames in flight each frame is encoded by one thread
+    if (settings.pipeline_depth > 1) {
+        return 1;
+    }
+    if (settings.threads > 0) {
+        return settings.threads;
+    }
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+MjpegFrameCapture::MjpegFrameCapture(const MjpegSettings& settings, Agent *agent):
+    settings(settings),agent(agent),dpy(XOpenDisplay(nullptr)),events(dpy),
+    encoder(encoding_threads(settings)),
+    pacer(settings.fps),
+    controller(controller_settings(settings)),
+    governor(governor_settings(settings)),
+    changes(change_rate_settings(settings)),
+    transport(dynamic_cast<TransportMonitor *>(agent)),
+    rate(settings.fps)
 {
     if (!dpy)
         throw std::runtime_error("Unable to initialize X11");
+    grabber.reset(new X11Capture(dpy));
+
+    if (settings.pipeline_depth > 1) {
+        pipeline.reset(new JpegPipeline(settings.pipeline_depth, buffers));
+    }
+
+    if (settings.damage) {
+        try {
+            damage.reset(new DamageMonitor(events, dpy, RootWindow(dpy, XDefaultScreen(dpy))));
+        } catch (const std::exception &e) {
+            syslog(LOG_WARNING, "%s, capturing at a fixed rate", e.what());
+        }
+    }
+
+    if (settings.idle_fps > 0 && settings.idle_fps < settings.fps) {
+        try {
+            input.reset(new InputMonitor(events, dpy, RootWindow(dpy, XDefaultScreen(dpy))));
+            update_rate();
+        } catch (const std::exception &e) {
+            syslog(LOG_WARNING, "%s, not lowering the frame rate when idle", e.what());
+        }
+    }
 }
 
 MjpegFrameCapture::~MjpegFrameCapture()
 {
+    const FramePacer::Stats &stats = pacer.stats();
+    syslog(LOG_DEBUG, "Frame pacing: %" PRIu64 " frames, %" PRIu64 " late, %" PRIu64 " ticks "
+           "skipped, jitter %" PRIu64 " us on average, %" PRIu64 " us at most",
+           stats.frames, stats.late, stats.skipped,
+           stats.total_jitter / std::max(stats.frames, uint64_t(1)) / 1000,
+           stats.max_jitter / 1000);
+
+    pipeline.reset();
+    input.reset();
+    damage.reset();
+    grabber.reset();
     XCloseDisplay(dpy);
 }
 
 void MjpegFrameCapture::Reset()
 {
-    frame.clear();
+    if (pipeline) {
+        pipeline->clear();
+    }
+    frame.reset();
+    have_frame = false;
+    encoder.invalidate();
+    prev_image = nullptr;
     last_width = last_height = -1;
 }
 
-FrameInfo MjpegFrameCapture::CaptureFrame()
+FrameInfo MjpegFrameCapture::last_frame_info()
 {
     FrameInfo info;
 
-    // reduce speed considering FPS
-    auto now = get_time();
-    if (last_time == 0) {
-        last_time = now;
-    } else {
-        const uint64_t delta = 1000000000u / settings.fps;
-        if (now >= last_time + delta) {
-            last_time = now;
-        } else {
-            uint64_t wait_time = last_time + delta - now;
-            // mathematically wait_time must be less than a second as
-            // delta would be 1 seconds only for FPS == 1 but in this
-            // side of the if now < last_time + delta
-            // but is also true that now > last_time so
-            // last_time + delta > now > last_time so
-            // 1s >= delta > now - last_time > 0 so
-            // wait_time = delta - (now - last_time) < delta <= 1s
-            timespec delay = { 0, (long) wait_time };
-            nanosleep(&delay, NULL);
-            last_time += delta;
+    info.size.width = last_width;
+    info.size.height = last_height;
+    info.buffer = frame->data();
+    info.buffer_size = frame->size();
+    info.stream_start = false;
+
+    last_sent = utils::get_time();
+
+    return info;
+}
+
+/* Set the frame rate of the pacer to the lowest one required by the
+ * quality controller and the CPU governor, and when the user is not
+ * active by the screen changes and the idle frame rate */
+void MjpegFrameCapture::update_rate()
+{
+    unsigned fps = std::min(controller.fps(), governor.fps());
+    bool active = false;
+    if (input) {
+        const uint64_t quiet_period = settings.input_quiet_period * 1000000ull;
+        uint64_t last_input = input->last_input();
+        active = last_input != 0 && utils::get_time() - last_input < quiet_period;
+        if (!active) {
+            fps = std::min(fps, unsigned(settings.idle_fps));
         }
     }
+    if (!active) {
+        fps = std::min(fps, changes.fps());
+    }
 
-    int screen = XDefaultScreen(dpy);
+    if (fps != rate) {
+        rate = fps;
+        pacer.set_rate(fps);
+        if (agent) {
+            agent->LogStat("Frame rate set to %u fps", fps);
+        }
+    }
+}
 
-    Window win = RootWindow(dpy, screen);
+/* Account for the tiles changed at a frame tick, adapting the frame
+ * rate to the share of the screen changing */
+void MjpegFrameCapture::account_changes(unsigned changed)
+{
+    if (!changes.enabled()) {
+        return;
+    }
 
-    XWindowAttributes win_info;
-    XGetWindowAttributes(dpy, win, &win_info);
+    if (changes.update(changed, tiles.columns() * tiles.rows())) {
+        update_rate();
+    }
+    if (agent) {
+        agent->LogStat("Screen change %u.%u%% per frame, capturing at %u fps",
+                       changes.change_ratio() / 10, changes.change_ratio() % 10, rate);
+    }
+}
 
-    bool is_first = false;
-    if (win_info.width != last_width || win_info.height != last_height) {
-        last_width = win_info.width;
-        last_height = win_info.height;
-        is_first = true;
+/* Wait for the deadline of the next frame. When idle, the user input
+ * raises the frame rate at once, bringing the deadline closer */
+void MjpegFrameCapture::wait_tick()
+{
+    if (input) {
+        update_rate();
+        while (events.wait_until(pacer.next_deadline())) {
+            update_rate();
+        }
+        update_rate();
     }
+    pacer.wait();
+}
 
-    info.size.width = win_info.width;
-    info.size.height = win_info.height;
+/* Wait for the next image to encode, with its changed tiles in the tiles
+ * member. Returns nullptr when the last frame should be sent again. */
+XImage *MjpegFrameCapture::next_image(bool &is_first)
+{
+    const uint64_t keepalive = settings.keepalive * 1000000ull;
+
+    for (;;) {
+        wait_tick();
+        if (agent) {
+            agent->LogStat("Frame paced with a jitter of %" PRIu64 " us (%" PRIu64 " late, "
+                           "%" PRIu64 " ticks skipped)", pacer.stats().last_jitter / 1000,
+                           pacer.stats().late, pacer.stats().skipped);
+        }
 
-    int format = ZPixmap;
-    // TODO handle errors
-    XImage *image = XGetImage(dpy, win, win_info.x, win_info.y,
-                              win_info.width, win_info.height, AllPlanes, format);
+        if (damage && have_frame) {
+            // nothing changed, send the last frame again once in a while
+            uint64_t now = utils::get_time();
+            bool changed = damage->wait(last_sent + keepalive > now ? last_sent + keepalive - now : 0);
+            // do not count the time spent waiting for the damage in the
+            // interval to the next frame, nor as late frames
+            pacer.restart();
+            if (!changed) {
+                account_changes(0);
+                return nullptr;
+            }
+        }
+
+        int screen = XDefaultScreen(dpy);
+
+        Window win = RootWindow(dpy, screen);
+
+        XWindowAttributes win_info;
+        XGetWindowAttributes(dpy, win, &win_info);
+
+        is_first = false;
+        if (win_info.width != last_width || win_info.height != last_height) {
+            last_width = win_info.width;
+            last_height = win_info.height;
+            is_first = true;
+        }
+
+        CpuGovernor::StageTimer timer(governor, CpuGovernor::CAPTURE);
+        XImage *image;
+        if (damage) {
+            // read only the damaged areas into the shadow copy of the screen
+            image = grabber->update(win, win_info.width, win_info.height,
+                                    damage->take_damage(), tiles);
+        } else {
+            image = grabber->grab(win, win_info.width, win_info.height);
+            if (prev_image && !is_first) {
+                tiles.compare((uint8_t*) prev_image->data, (uint8_t*) image->data,
+                              image->width, image->height, image->bytes_per_line);
+            }
+        }
+
+        if (is_first || !have_frame || (!damage && !prev_image)) {
+            tiles.mark_all(image->width, image->height);
+        } else if (tiles.count() == 0) {
+            // static screen, skip encoding unless the keep-alive is due
+            prev_image = image;
+            account_changes(0);
+            if (utils::get_time() - last_sent >= keepalive) {
+                return nullptr;
+            }
+            continue;
+        }
+        prev_image = image;
+        have_frame = true;
+        account_changes(tiles.count());
+
+        return image;
+    }
+}
+
+FrameInfo MjpegFrameCapture::CaptureFrame()
+{
+    FrameInfo info = pipeline ? pipelined_frame() : encoded_frame();
+    adapt_quality(info.buffer_size);
+    govern_cpu();
+    return info;
+}
+
+/* The lowest of the qualities required by the port and the CPU limit */
+int MjpegFrameCapture::quality() const
+{
+    return std::min(controller.quality(), governor.quality());
+}
+
+FrameInfo MjpegFrameCapture::encoded_frame()
+{
+    bool is_first;
+    XImage *image = next_image(is_first);
+    if (!image) {
+        return last_frame_info();
+    }
 
     // TODO handle errors
     // TODO multiple formats (only 32 bit)
-    write_JPEG_file(frame, settings.quality, (uint8_t*) image->data,
-                    image->width, image->height);
+    // only the stripes with changed tiles are encoded again
+    std::shared_ptr<FrameBuffer> buffer = buffers.get();
+    {
+        CpuGovernor::StageTimer timer(governor, CpuGovernor::ENCODE);
+        encoder.encode(*buffer, quality(), (uint8_t*) image->data,
+                       image->width, image->height, image->bytes_per_line, &tiles);
+    }
+    frame = buffer;
+    last_sent = utils::get_time();
 
-    image->f.destroy_image(image);
+    FrameInfo info;
+    info.size.width = image->width;
+    info.size.height = image->height;
+    info.buffer = frame->data();
+    info.buffer_size = frame->size();
+    info.stream_start = is_first;
 
-    info.buffer = &frame[0];
-    info.buffer_size = frame.size();
+    return info;
+}
 
-    info.stream_start = is_first;
+/* Capture frames until the pipeline is full, then release the oldest one */
+FrameInfo MjpegFrameCapture::pipelined_frame()
+{
+    while (!pipeline->full()) {
+        bool is_first;
+        XImage *image = next_image(is_first);
+
+        FrameInfo info;
+        info.size.width = last_width;
+        info.size.height = last_height;
+        info.stream_start = is_first;
+
+        if (image) {
+            // convert now, the image is overwritten by the next capture
+            CpuGovernor::StageTimer timer(governor, CpuGovernor::ENCODE);
+            YCbCrImage &ycbcr = pipeline->next_image();
+            ycbcr.resize(image->width, image->height);
+            bgrx_to_ycbcr420((uint8_t*) image->data, image->bytes_per_line, ycbcr);
+            pipeline->submit(quality(), info);
+        } else {
+            info.stream_start = false;
+            pipeline->submit_repeat(info);
+        }
+        last_sent = utils::get_time();
+    }
 
+    JpegPipeline::Timings timings;
+    FrameInfo info = pipeline->take(frame, timings);
+    if (agent) {
+        agent->LogStat("Frame released after %" PRIu64 " us (encoding %" PRIu64 " us, "
+                       "queued %" PRIu64 " us)", timings.total / 1000, timings.encode / 1000,
+                       (timings.total - std::min(timings.total, timings.encode)) / 1000);
+    }
     return info;
 }
 
+void MjpegFrameCapture::adapt_quality(size_t frame_size)
+{
+    if (!controller.enabled()) {
+        return;
+    }
+
+    TransportStats stats{};
+    if (transport) {
+        stats = transport->GetTransportStats();
+    }
+    if (!controller.update(utils::get_time(), frame_size, transport ? &stats : nullptr)) {
+        return;
+    }
+
+    update_rate();
+    if (agent) {
+        agent->LogStat("Quality set to %d at %u fps (bitrate %" PRIu64 " kbit/s, "
+                       "frame written in %" PRIu64 " us)", controller.quality(), controller.fps(),
+                       controller.bitrate() / 1000, controller.latency() / 1000);
+    }
+}
+
+void MjpegFrameCapture::govern_cpu()
+{
+    if (!governor.update()) {
+        return;
+    }
+
+    update_rate();
+    syslog(LOG_DEBUG, "CPU usage %u%% (capture %u%%, encoding %u%% of a CPU), "
+           "limited to %u fps and quality %d", governor.usage(),
+           governor.stage_usage(CpuGovernor::CAPTURE), governor.stage_usage(CpuGovernor::ENCODE),
+           governor.fps(), governor.quality());
+    if (agent) {
+        agent->LogStat("CPU usage %u%%, limited to %u fps and quality %d",
+                       governor.usage(), governor.fps(), governor.quality());
+    }
+}
+
 std::vector<DeviceDisplayInfo> MjpegFrameCapture::get_device_display_info() const
 {
     try {
@@ -150,7 +485,7 @@ std::vector<DeviceDisplayInfo> MjpegFrameCapture::get_device_display_info() cons
 
 FrameCapture *MjpegPlugin::CreateCapture()
 {
-    return new MjpegFrameCapture(settings);
+    return new MjpegFrameCapture(settings, agent);
 }
 
 unsigned MjpegPlugin::Rank()
@@ -176,6 +511,112 @@ void MjpegPlugin::ParseOptions(const ConfigureOption *options)
             } catch (const std::exception &e) {
                 throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.quality'.");
             }
+        } else if (name == "mjpeg.keepalive") {
+            try {
+                settings.keepalive = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.keepalive'.");
+            }
+            if (settings.keepalive <= 0) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.keepalive'.");
+            }
+        } else if (name == "mjpeg.threads") {
+            try {
+                settings.threads = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.threads'.");
+            }
+            if (settings.threads < 0) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.threads'.");
+            }
+        } else if (name == "mjpeg.pipeline-depth") {
+            try {
+                settings.pipeline_depth = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.pipeline-depth'.");
+            }
+            if (settings.pipeline_depth < 1) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.pipeline-depth'.");
+            }
+        } else if (name == "mjpeg.target-bitrate") {
+            try {
+                settings.target_bitrate = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.target-bitrate'.");
+            }
+            if (settings.target_bitrate < 0) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.target-bitrate'.");
+            }
+        } else if (name == "mjpeg.max-latency") {
+            try {
+                settings.max_latency = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.max-latency'.");
+            }
+            if (settings.max_latency < 0) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.max-latency'.");
+            }
+        } else if (name == "mjpeg.min-quality") {
+            try {
+                settings.min_quality = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.min-quality'.");
+            }
+            if (settings.min_quality < 1 || settings.min_quality > 100) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.min-quality'.");
+            }
+        } else if (name == "mjpeg.adaptive-fps") {
+            if (value == "on") {
+                settings.adaptive_fps = true;
+            } else if (value == "off") {
+                settings.adaptive_fps = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.adaptive-fps'.");
+            }
+        } else if (name == "cpu-limit") {
+            try {
+                settings.cpu_limit = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'cpu-limit'.");
+            }
+            if (settings.cpu_limit < 0 || settings.cpu_limit > 100) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'cpu-limit'.");
+            }
+        } else if (name == "mjpeg.idle-framerate") {
+            try {
+                settings.idle_fps = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.idle-framerate'.");
+            }
+            if (settings.idle_fps < 0) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.idle-framerate'.");
+            }
+        } else if (name == "mjpeg.input-quiet-period") {
+            try {
+                settings.input_quiet_period = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.input-quiet-period'.");
+            }
+            if (settings.input_quiet_period < 0) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'mjpeg.input-quiet-period'.");
+            }
+        } else if (name == "min-framerate") {
+            try {
+                settings.min_fps = stoi(value);
+            } catch (const std::exception &e) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'min-framerate'.");
+            }
+            if (settings.min_fps < 0) {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'min-framerate'.");
+            }
+        } else if (name == "damage") {
+            if (value == "on") {
+                settings.damage = true;
+            } else if (value == "off") {
+                settings.damage = false;
+            } else {
+                throw std::runtime_error("Invalid value '" + value + "' for option 'damage'.");
+            }
         }
     }
 }
@@ -192,6 +633,7 @@ SpiceVideoCodecType MjpegPlugin::VideoCodecType() const {
 bool MjpegPlugin::Register(Agent* agent)
 {
     auto plugin = std::make_shared<MjpegPlugin>();
+    plugin->agent = agent;
 
     try {
         plugin->ParseOptions(agent->Options());
@@ -15,8 +15,32 @@ namespace streaming_agent {
 
 struct MjpegSettings
 {
-    int fps;
-    int quality;
+    int fps = 10;
+    int quality = 80;
+    /*! interval in ms after which an unchanged frame is sent again */
+    int keepalive = 1000;
+    /*! capture only when the screen changed (using the DAMAGE extension) */
+    bool damage = true;
+    /*! number of threads encoding a frame, 0 for one per CPU */
+    int threads = 0;
+    /*! number of frames encoded at the same time */
+    int pipeline_depth = 1;
+    /*! bitrate the quality is adapted to in kbit/s, 0 for none */
+    int target_bitrate = 0;
+    /*! maximum time to write a frame to the port in ms, 0 for no limit */
+    int max_latency = 0;
+    /*! lowest quality when adapting it */
+    int min_quality = 20;
+    /*! lower the frame rate too when the quality is the lowest */
+    bool adaptive_fps = false;
+    /*! maximum CPU usage in percent of all the CPUs, 0 for no limit */
+    int cpu_limit = 0;
+    /*! frame rate without user input, 0 to always use fps */
+    int idle_fps = 0;
+    /*! time in ms without user input after which idle_fps is used */
+    int input_quiet_period = 1000;
+    /*! frame rate when the screen does not change, 0 to always use fps */
+    int min_fps = 0;
 };
 
 class MjpegPlugin final: public Plugin
@@ -29,7 +53,8 @@ public:
     SpiceVideoCodecType VideoCodecType() const override;
     static bool Register(Agent* agent);
 private:
-    MjpegSettings settings = { 10, 80 };
+    MjpegSettings settings;
+    Agent *agent = nullptr;
 };
 
 }} // namespace spice::streaming_agent
@@ -0,0 +1,185 @@
+/* JPEG encoding of horizontal stripes on multiple threads.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "parallel-jpeg.hpp"
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <algorithm>
+
+
+namespace spice {
+namespace streaming_agent {
+
+constexpr unsigned ParallelJpegEncoder::stripe_rows;
+
+namespace {
+
+const uint8_t marker_sof0 = 0xc0;
+const uint8_t marker_rst0 = 0xd0;
+const uint8_t marker_soi = 0xd8;
+const uint8_t marker_eoi = 0xd9;
+const uint8_t marker_sos = 0xda;
+const uint8_t marker_dri = 0xdd;
+
+/* Position of the elements of a JPEG image produced by libjpeg */
+struct JpegLayout
+{
+    // offset of the height in the SOF0 segment
+    size_t height;
+    // offset of the SOS marker
+    size_t sos;
+    // offset of the entropy coded data, following the SOS segment
+    size_t scan;
+    // offset of the EOI marker ending the entropy coded data
+    size_t eoi;
+};
+
+JpegLayout parse_jpeg(const FrameBuffer &buffer)
+{
+    const uint8_t *jpeg = buffer.data();
+    const size_t size = buffer.size();
+    JpegLayout layout = {};
+    size_t pos = 2;
+
+    if (size < 4 || jpeg[0] != 0xff || jpeg[1] != marker_soi) {
+        throw Error("invalid JPEG stripe: missing SOI");
+    }
+    // the markers before the scan are all followed by their length
+    while (pos + 4 <= size && jpeg[pos] == 0xff) {
+        uint8_t marker = jpeg[pos + 1];
+        size_t length = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+        if (marker == marker_sof0) {
+            layout.height = pos + 5;
+        } else if (marker == marker_sos) {
+            layout.sos = pos;
+            layout.scan = pos + 2 + length;
+            break;
+        }
+        pos += 2 + length;
+    }
+    if (!layout.height || !layout.sos || layout.scan + 2 > size ||
+        jpeg[size - 2] != 0xff || jpeg[size - 1] != marker_eoi) {
+        throw Error("invalid JPEG stripe: unexpected structure");
+    }
+    layout.eoi = size - 2;
+    return layout;
+}
+
+}
+
+ParallelJpegEncoder::ParallelJpegEncoder(unsigned threads):
+    pool(std::max(threads, 1u))
+{
+    for (unsigned i = 0; i < pool.size(); ++i) {
+        encoders.emplace_back(new JpegEncoder);
+    }
+}
+
+void ParallelJpegEncoder::invalidate()
+{
+    quality = -1;
+}
+
+void ParallelJpegEncoder::encode(FrameBuffer &buffer, int quality,
+                                 const uint8_t *data, unsigned width, unsigned height,
+                                 size_t stride, const TileDiff *changes)
+{
+    const unsigned block = YCbCrImage::block_size;
+    static_assert(TileDiff::tile_height == YCbCrImage::block_size,
+                  "tile rows must match MCU rows");
+
+    image.resize(width, height);
+
+    // split in stripes of whole MCU rows
+    const unsigned mcu_columns = image.padded_width / block;
+    const unsigned mcu_rows = image.padded_height / block;
+    // the restart interval is limited to 16 bits
+    const unsigned rows = std::max(std::min(stripe_rows, 65535u / mcu_columns), 1u);
+    const unsigned count = (mcu_rows + rows - 1) / rows;
+
+    if (count <= 1) {
+        invalidate();
+        bgrx_to_ycbcr420(data, stride, image);
+        encoders[0]->encode(buffer, quality, image);
+        encoded = 1;
+        return;
+    }
+
+    // reuse the stripes of the previous image which did not change
+    bool reuse = changes && quality == this->quality && width == this->width &&
+        height == this->height && stripes.size() == count && changes->rows() == mcu_rows;
+    dirty.clear();
+    for (unsigned stripe = 0; stripe < count; ++stripe) {
+        bool changed = !reuse;
+        const unsigned last_row = std::min((stripe + 1) * rows, mcu_rows);
+        for (unsigned row = stripe * rows; !changed && row < last_row; ++row) {
+            changed = changes->row_changed(row);
+        }
+        if (changed) {
+            dirty.push_back(stripe);
+        }
+    }
+
+    // forget the cache while the stripes are being replaced, in case of error
+    invalidate();
+    stripes.resize(count);
+    pool.run(dirty.size(), [&](unsigned task, unsigned worker) {
+        unsigned stripe = dirty[task];
+        unsigned first_row = stripe * rows * block;
+        unsigned last_row = std::min(first_row + rows * block, height);
+        bgrx_to_ycbcr420(data, stride, image, first_row, first_row + rows * block);
+        encoders[worker]->encode(stripes[stripe], quality, image,
+                                 first_row, last_row - first_row);
+    });
+    encoded = dirty.size();
+
+    splice(buffer, mcu_columns * rows);
+
+    this->quality = quality;
+    this->width = width;
+    this->height = height;
+}
+
+void ParallelJpegEncoder::splice(FrameBuffer &buffer, unsigned restart_interval)
+{
+    const JpegLayout first = parse_jpeg(stripes[0]);
+    const uint8_t dri[] = {
+        0xff, marker_dri, 0, 4,
+        uint8_t(restart_interval >> 8), uint8_t(restart_interval),
+    };
+
+    const uint8_t eoi[] = { 0xff, marker_eoi };
+
+    size_t total = sizeof(dri) + sizeof(eoi);
+    for (const auto &stripe : stripes) {
+        total += stripe.size() + 2;
+    }
+
+    // headers of the first stripe, with the height of the whole image
+    buffer.clear();
+    buffer.reserve(total);
+    buffer.append(stripes[0].data(), first.sos);
+    buffer.append(dri, sizeof(dri));
+    buffer.append(stripes[0].data() + first.sos, first.scan - first.sos);
+    unsigned height = 0;
+    for (unsigned i = 0; i < stripes.size(); ++i) {
+        const uint8_t *stripe = stripes[i].data();
+        const JpegLayout layout = i ? parse_jpeg(stripes[i]) : first;
+        height += (stripe[layout.height] << 8) | stripe[layout.height + 1];
+        if (i) {
+            const uint8_t rst[] = { 0xff, uint8_t(marker_rst0 + (i - 1) % 8) };
+            buffer.append(rst, sizeof(rst));
+        }
+        buffer.append(stripe + layout.scan, layout.eoi - layout.scan);
+    }
+    buffer.append(eoi, sizeof(eoi));
+
+    buffer.data()[first.height] = height >> 8;
+    buffer.data()[first.height + 1] = height;
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,83 @@
+/* JPEG encoding of horizontal stripes on multiple threads.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include "color-convert.hpp"
+#include "jpeg.hpp"
+#include "tile-diff.hpp"
+#include "worker-pool.hpp"
+
+#include <memory>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * JPEG encoder of 32 bit BGRX images splitting them in horizontal stripes
+ * converted and encoded in parallel.
+ *
+ * Each stripe is a whole number of MCU rows encoded as a separate image.
+ * The entropy coded data of the stripes are then concatenated into a
+ * single baseline JPEG image, the restart interval (DRI) being the number
+ * of MCUs of a stripe and the stripes separated by RSTn markers. Restart
+ * markers reset the DC predictions like the start of an image does, so
+ * the result is the same as if the image was encoded with restarts.
+ *
+ * The encoded stripes are kept so that, given the tiles which changed
+ * since the previous frame, only the stripes containing changed tiles
+ * are converted and encoded again.
+ */
+class ParallelJpegEncoder
+{
+public:
+    /*! \param threads number of threads encoding the stripes */
+    explicit ParallelJpegEncoder(unsigned threads);
+
+    /*!
+     * Encode an image, replacing the content of buffer with the JPEG data.
+     * \param changes the tiles which changed since the previous image
+     * encoded, or nullptr to encode the whole image
+     * Throws an Error if the encoding fails.
+     */
+    void encode(FrameBuffer &buffer, int quality,
+                const uint8_t *data, unsigned width, unsigned height, size_t stride,
+                const TileDiff *changes = nullptr);
+
+    /*! Forget the stripes of the previous image */
+    void invalidate();
+
+    /*! Number of stripes encoded for the last image */
+    unsigned encoded_stripes() const
+    {
+        return encoded;
+    }
+
+    /*!
+     * Number of MCU rows of a stripe. Small stripes make the cache
+     * effective, large ones limit the per stripe overhead.
+     */
+    static constexpr unsigned stripe_rows = 4;
+
+private:
+    void splice(FrameBuffer &buffer, unsigned restart_interval);
+
+    WorkerPool pool;
+    // one encoder per worker thread
+    std::vector<std::unique_ptr<JpegEncoder>> encoders;
+    std::vector<FrameBuffer> stripes;
+    // stripes to encode for the current image
+    std::vector<unsigned> dirty;
+    unsigned encoded = 0;
+    YCbCrImage image;
+    // parameters of the cached stripes, quality is -1 if there are none
+    int quality = -1;
+    unsigned width = 0, height = 0;
+};
+
+}} // namespace spice::streaming_agent
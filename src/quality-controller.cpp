@@ -0,0 +1,129 @@
+/* Adaptation of the encoding quality to the transport.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "quality-controller.hpp"
+
+#include <algorithm>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+// frames over the limits before lowering the quality
+constexpr unsigned frames_to_decrease = 2;
+// frames well below the limits before raising the quality
+constexpr unsigned frames_to_increase = 30;
+// frames ignored after a change, the time for the estimates to follow
+constexpr unsigned hold_frames = 8;
+constexpr int quality_step = 5;
+
+/* Moving average giving a weight of 1/8 to the new value */
+uint64_t smooth(uint64_t average, uint64_t value)
+{
+    if (average == 0) {
+        return value;
+    }
+    return average - average / 8 + value / 8;
+}
+
+}
+
+QualityController::QualityController(const Settings &settings):
+    settings(settings),
+    current_quality(settings.max_quality),
+    current_fps(std::max(settings.max_fps, 1u))
+{
+}
+
+bool QualityController::update(uint64_t now, size_t frame_size, const TransportStats *stats)
+{
+    if (last_time == 0 || now <= last_time) {
+        last_time = now;
+        if (stats) {
+            last_stats = *stats;
+        }
+        return false;
+    }
+
+    const uint64_t elapsed = now - last_time;
+    last_time = now;
+    bitrate_estimate = smooth(bitrate_estimate, frame_size * 8000000000ull / elapsed);
+
+    if (stats) {
+        uint64_t sent = stats->bytes_sent - last_stats.bytes_sent;
+        uint64_t write_time = stats->write_time - last_stats.write_time;
+        last_stats = *stats;
+        if (sent > 0 && write_time > 0) {
+            port_rate = smooth(port_rate, sent * 1000000000ull / write_time);
+        }
+        if (port_rate > 0) {
+            latency_estimate = smooth(latency_estimate, frame_size * 1000000000ull / port_rate);
+        }
+    }
+
+    if (!enabled()) {
+        return false;
+    }
+    if (hold > 0) {
+        --hold;
+        return false;
+    }
+
+    const bool over = (settings.target_bitrate && bitrate_estimate > settings.target_bitrate) ||
+        (settings.max_latency && latency_estimate > settings.max_latency);
+    const bool under = (!settings.target_bitrate ||
+                        bitrate_estimate < settings.target_bitrate / 4 * 3) &&
+        (!settings.max_latency || latency_estimate < settings.max_latency / 2);
+
+    frames_over = over ? frames_over + 1 : 0;
+    frames_under = under ? frames_under + 1 : 0;
+
+    bool changed;
+    if (frames_over >= frames_to_decrease) {
+        changed = decrease();
+    } else if (frames_under >= frames_to_increase) {
+        changed = increase();
+    } else {
+        return false;
+    }
+
+    frames_over = frames_under = 0;
+    if (changed) {
+        hold = hold_frames;
+    }
+    return changed;
+}
+
+bool QualityController::decrease()
+{
+    if (current_quality > settings.min_quality) {
+        current_quality = std::max(current_quality - quality_step, settings.min_quality);
+        return true;
+    }
+    if (settings.adapt_fps && current_fps > 1) {
+        current_fps = std::max(current_fps * 3 / 4, 1u);
+        return true;
+    }
+    return false;
+}
+
+bool QualityController::increase()
+{
+    // restore the frame rate first, it was lowered last
+    if (current_fps < settings.max_fps) {
+        current_fps = std::min(current_fps + std::max(current_fps / 4, 1u), settings.max_fps);
+        return true;
+    }
+    if (current_quality < settings.max_quality) {
+        current_quality = std::min(current_quality + quality_step, settings.max_quality);
+        return true;
+    }
+    return false;
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,105 @@
+/* Adaptation of the encoding quality to the transport.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <spice-streaming-agent/transport-monitor.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Closed loop controller of the JPEG quality, and optionally of the frame
+ * rate, keeping the stream under a target bitrate and the time to write a
+ * frame to the port under a latency ceiling.
+ *
+ * The rates are smoothed over the last frames. The quality is lowered
+ * as soon as a limit is exceeded for a couple of frames, but only raised
+ * after the stream stayed well below the limits for a while, and no
+ * change is made until the estimates reflect the previous one, so the
+ * quality does not oscillate around a limit.
+ */
+class QualityController
+{
+public:
+    struct Settings
+    {
+        /*! highest quality, used at the start */
+        int max_quality = 80;
+        int min_quality = 20;
+        /*! highest frame rate, used at the start */
+        unsigned max_fps = 10;
+        /*! lower the frame rate when the quality is already the lowest */
+        bool adapt_fps = false;
+        /*! in bits per second, 0 for no target */
+        uint64_t target_bitrate = 0;
+        /*! maximum time to write a frame to the port in ns, 0 for no limit */
+        uint64_t max_latency = 0;
+    };
+
+    explicit QualityController(const Settings &settings);
+
+    /*! Whether there is a target bitrate or latency to control */
+    bool enabled() const
+    {
+        return settings.target_bitrate != 0 || settings.max_latency != 0;
+    }
+
+    /*!
+     * Account for a frame, possibly changing the quality and frame rate of
+     * the next ones.
+     * \param now the current time on CLOCK_MONOTONIC, in ns
+     * \param frame_size size of the encoded frame
+     * \param stats counters of the port, nullptr if not known
+     * \return whether the quality or the frame rate changed
+     */
+    bool update(uint64_t now, size_t frame_size, const TransportStats *stats);
+
+    int quality() const
+    {
+        return current_quality;
+    }
+    unsigned fps() const
+    {
+        return current_fps;
+    }
+
+    /*! Smoothed bitrate of the encoded frames, in bits per second */
+    uint64_t bitrate() const
+    {
+        return bitrate_estimate;
+    }
+    /*! Smoothed time to write a frame to the port, in ns */
+    uint64_t latency() const
+    {
+        return latency_estimate;
+    }
+
+private:
+    bool decrease();
+    bool increase();
+
+    const Settings settings;
+    int current_quality;
+    unsigned current_fps;
+
+    uint64_t last_time = 0;
+    TransportStats last_stats{};
+    uint64_t bitrate_estimate = 0;
+    // bytes per second the port accepts while writing
+    uint64_t port_rate = 0;
+    uint64_t latency_estimate = 0;
+    // consecutive frames above the limits or well below them
+    unsigned frames_over = 0, frames_under = 0;
+    // frames to wait before deciding again after a change
+    unsigned hold = 0;
+};
+
+}} // namespace spice::streaming_agent
@@ -7,7 +7,10 @@
 #include "concrete-agent.hpp"
 #include "mjpeg-fallback.hpp"
 #include "cursor-updater.hpp"
+#include "event-loop.hpp"
+#include "frame-buffer.hpp"
 #include "frame-log.hpp"
+#include "frame-queue.hpp"
 #include "stream-port.hpp"
 #include "utils.hpp"
 #include <spice-streaming-agent/error.hpp>
@@ -28,15 +31,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/time.h>
-#include <poll.h>
+#include <sys/epoll.h>
 #include <syslog.h>
 #include <signal.h>
 #include <algorithm>
+#include <atomic>
 #include <exception>
 #include <stdexcept>
 #include <memory>
 #include <vector>
 #include <string>
+#include <thread>
 
 #include <common/utils.h>
 
@@ -52,15 +57,17 @@ public:
         return sizeof(PayloadType);
     }
 
-    void write_message_body(StreamPort &stream_port, unsigned w, unsigned h, uint8_t c)
+    void collect_body(IoVector &iov, unsigned w, unsigned h, uint8_t c)
     {
-        StreamMsgFormat msg{};
         msg.width = w;
         msg.height = h;
         msg.codec = c;
 
-        stream_port.write(&msg, sizeof(msg));
+        iov.add(&msg, sizeof(msg));
     }
+
+private:
+    StreamMsgFormat msg{};
 };
 
 class FrameMessage : public OutboundMessage<StreamMsgData, FrameMessage, STREAM_TYPE_DATA>
@@ -73,9 +80,9 @@ public:
         return sizeof(PayloadType) + length;
     }
 
-    void write_message_body(StreamPort &stream_port, const void *frame, size_t length)
+    void collect_body(IoVector &iov, const void *frame, size_t length)
     {
-        stream_port.write(frame, length);
+        iov.add(frame, length);
     }
 };
 
@@ -91,9 +98,8 @@ public:
         return sizeof(PayloadType) + sizeof(caps);
     }
 
-    void write_message_body(StreamPort &stream_port, const std::vector<bool> &capabilities)
+    void collect_body(IoVector &iov, const std::vector<bool> &capabilities)
     {
-        uint8_t caps[AgentCapabilitiesBytes] = {};
         size_t i = 0;
 
         for (auto cap: capabilities) {
@@ -102,8 +108,11 @@ public:
             }
             i++;
         }
-        stream_port.write(caps, sizeof(caps));
+        iov.add(caps, sizeof(caps));
     }
+
+private:
+    uint8_t caps[AgentCapabilitiesBytes] = {};
 };
 
 class DeviceDisplayInfoMessage : public OutboundMessage<StreamMsgDeviceDisplayInfo, DeviceDisplayInfoMessage, STREAM_TYPE_DEVICE_DISPLAY_INFO>
@@ -118,50 +127,130 @@ public:
                1;
     }
 
-    void write_message_body(StreamPort &stream_port, const DeviceDisplayInfo &info)
+    void collect_body(IoVector &iov, const DeviceDisplayInfo &info)
     {
-        std::string device_address = info.device_address;
+        device_address = info.device_address;
         if (device_address.length() > max_device_address_len) {
             syslog(LOG_WARNING,
                    "device address of stream id %u is longer than %u bytes, trimming.",
                    info.stream_id, max_device_address_len);
             device_address = device_address.substr(0, max_device_address_len);
         }
-        StreamMsgDeviceDisplayInfo strm_msg_info{};
         strm_msg_info.stream_id = info.stream_id;
         strm_msg_info.device_display_id = info.device_display_id;
         strm_msg_info.device_address_len = device_address.length() + 1;
-        stream_port.write(&strm_msg_info, sizeof(strm_msg_info));
-        stream_port.write(device_address.c_str(), device_address.length() + 1);
+        iov.add(&strm_msg_info, sizeof(strm_msg_info));
+        iov.add(device_address.c_str(), device_address.length() + 1);
     }
 
 private:
     static constexpr uint32_t max_device_address_len = 255;
+    StreamMsgDeviceDisplayInfo strm_msg_info{};
+    std::string device_address;
 };
 
-static bool streaming_requested = false;
-static bool quit_requested = false;
-static std::set<SpiceVideoCodecType> client_codecs;
-
-static bool have_something_to_read(StreamPort &stream_port, bool blocking)
+/*!
+ * Writes the frames to the port from its own thread, so the capture and
+ * the encoding of the next frames go on while the port is busy.
+ */
+class FrameWriter
 {
-    struct pollfd pollfd = {stream_port.fd, POLLIN, 0};
+public:
+    FrameWriter(StreamPort &stream_port, FrameLog &frame_log, unsigned depth);
+    ~FrameWriter();
+    FrameWriter(const FrameWriter &) = delete;
+    FrameWriter &operator=(const FrameWriter &) = delete;
 
-    if (poll(&pollfd, 1, blocking ? -1 : 0) < 0) {
-        if (errno == EINTR) {
-            // report nothing to read, next iteration of the enclosing loop will retry
-            return false;
-        }
+    /*!
+     * Queue a frame, waiting while the queue is full.
+     * Rethrows the error which stopped the writer thread, if any.
+     */
+    void push(QueuedFrame &&frame);
+
+private:
+    void run();
+
+    StreamPort &stream_port;
+    FrameLog &frame_log;
+    FrameQueue queue;
+    // drops already logged
+    uint64_t drops_logged = 0;
+    // set by the writer thread before closing the queue
+    std::exception_ptr error;
+    std::thread thread;
+};
 
-        throw IOError("poll failed on the device", errno);
+/*!
+ * Runs the capture of the frames and their sending to the port in its own
+ * thread, the main thread handling the commands of the server and the
+ * cursor updates in the event loop.
+ *
+ * The thread may be blocked by a full port, so it is not waited for when
+ * stopping: it is joined from the loop once it notifies it finished, and
+ * a new streaming requested in the meantime is started then.
+ */
+class CaptureThread
+{
+public:
+    /*!
+     * \param queue_depth number of frames waiting to be written to the port
+     * by a separate thread, 0 to write them from the capture thread
+     * \param drop_frames whether the queued frames which can be decoded
+     * alone are dropped when a newer frame is queued
+     */
+    CaptureThread(StreamPort &stream_port, FrameLog &frame_log, ConcreteAgent &agent,
+                  EventLoop &loop, unsigned queue_depth, bool drop_frames):
+        stream_port(stream_port), frame_log(frame_log), agent(agent), loop(loop),
+        queue_depth(queue_depth), drop_frames(drop_frames)
+    {
+    }
+    ~CaptureThread()
+    {
+        stopping = true;
+        if (thread.joinable()) {
+            // the agent exits, do not wait for the server to read a frame
+            stream_port.interrupt();
+            thread.join();
+        }
     }
+    CaptureThread(const CaptureThread &) = delete;
+    CaptureThread &operator=(const CaptureThread &) = delete;
 
-    if (pollfd.revents & POLLIN) {
-        return true;
+    /*! Whether streaming, not counting a thread being stopped */
+    bool running() const
+    {
+        return thread.joinable() && !stopping;
     }
 
-    return false;
-}
+    /*!
+     * Start streaming with one of the given codecs, once the previous
+     * thread finished if it is being stopped
+     */
+    void start(const std::set<SpiceVideoCodecType> &codecs);
+    /*! Stop streaming, without waiting for the frame being captured or sent */
+    void stop();
+
+private:
+    void run(std::set<SpiceVideoCodecType> codecs);
+    void stream(const std::set<SpiceVideoCodecType> &codecs);
+    void finished(std::exception_ptr error);
+
+    StreamPort &stream_port;
+    FrameLog &frame_log;
+    ConcreteAgent &agent;
+    EventLoop &loop;
+    const unsigned queue_depth;
+    const bool drop_frames;
+    FrameBufferPool buffers;
+    std::thread thread;
+    std::atomic<bool> stopping{false};
+    // streaming to start once the thread being stopped finished
+    bool restart = false;
+    std::set<SpiceVideoCodecType> restart_codecs;
+    unsigned int frame_count = 0;
+};
+
+static std::set<SpiceVideoCodecType> client_codecs;
 
 static void server_capabilities_received(StreamPort &stream_port,
                                          std::vector<bool> &server_capabilities)
@@ -174,72 +263,82 @@ static void server_capabilities_received(StreamPort &stream_port,
 #endif
 }
 
-static void read_command_from_device(StreamPort &stream_port)
+static void read_command_from_device(StreamPort &stream_port, CaptureThread &capture)
 {
-    InboundMessage in_message = stream_port.receive();
+    // the rest of a partial message is read once it arrives
+    std::unique_ptr<InboundMessage> in_message = stream_port.receive();
+    if (!in_message) {
+        return;
+    }
 
-    switch (in_message.header.type) {
+    switch (in_message->header.type) {
     case STREAM_TYPE_CAPABILITIES: {
-        InCapabilitiesMessage msg = in_message.get_payload<InCapabilitiesMessage>();
+        InCapabilitiesMessage msg = in_message->get_payload<InCapabilitiesMessage>();
         std::vector<bool> agent_capabilities(STREAM_CAP_END, false);
 
         server_capabilities_received(stream_port, msg.capabilities);
 
         // populate here the `agent_capabilities` vector
         // agent_capabilities[STREAM_CAP_...] = true;
-        stream_port.send<CapabilitiesOutMessage>(agent_capabilities);
+        // do not wait for the frame being written, if any
+        stream_port.post<CapabilitiesOutMessage>(agent_capabilities);
         return;
     }
     case STREAM_TYPE_NOTIFY_ERROR: {
-        NotifyErrorMessage msg = in_message.get_payload<NotifyErrorMessage>();
+        NotifyErrorMessage msg = in_message->get_payload<NotifyErrorMessage>();
 
         syslog(LOG_ERR, "Received NotifyError message from the server: %d - %s",
                msg.error_code, msg.message);
         return;
     }
     case STREAM_TYPE_START_STOP: {
-        StartStopMessage msg = in_message.get_payload<StartStopMessage>();
-        streaming_requested = msg.start_streaming;
+        StartStopMessage msg = in_message->get_payload<StartStopMessage>();
         client_codecs = msg.client_codecs;
 
         syslog(LOG_INFO, "GOT START_STOP message -- request to %s streaming",
-               streaming_requested ? "START" : "STOP");
+               msg.start_streaming ? "START" : "STOP");
+        if (!msg.start_streaming) {
+            capture.stop();
+        } else if (!capture.running()) {
+            capture.start(client_codecs);
+        }
         return;
     }}
 
-    throw std::runtime_error("UNKNOWN msg of type " + std::to_string(in_message.header.type));
+    throw std::runtime_error("UNKNOWN msg of type " + std::to_string(in_message->header.type));
 }
 
-static void read_command(StreamPort &stream_port, bool blocking)
+static void watch_stream_port(EventLoop &loop, StreamPort &stream_port, CaptureThread &capture,
+                              int retry_timer)
 {
-    while (!quit_requested) {
-        if (have_something_to_read(stream_port, blocking)) {
-            read_command_from_device(stream_port);
-            break;
+    loop.add(stream_port.fd, EPOLLIN,
+             [&loop, &stream_port, &capture, retry_timer](uint32_t events) {
+        if (events & EPOLLIN) {
+            read_command_from_device(stream_port, capture);
+        } else if (events & (EPOLLHUP | EPOLLERR)) {
+            // the hangup is reported until the server opens the port, so
+            // stop watching it for a while instead of spinning
+            loop.remove(stream_port.fd);
+            loop.set_timer(retry_timer, 1000000000);
         }
-
-        if (!blocking) {
-            break;
-        }
-
-        sleep(1);
-    }
+    });
 }
 
-static void handle_interrupt(int intr)
+static void send_frame(StreamPort &stream_port, FrameLog &frame_log, const QueuedFrame &frame,
+                       const void *data, size_t size)
 {
-    syslog(LOG_INFO, "Got signal %d, exiting", intr);
-    quit_requested = true;
-}
+    uint64_t time_before = FrameLog::get_time();
 
-static void register_interrupts(void)
-{
-    struct sigaction sa = { };
-    sa.sa_handler = handle_interrupt;
-    if ((sigaction(SIGINT, &sa, NULL) != 0) &&
-        (sigaction(SIGTERM, &sa, NULL) != 0)) {
-        syslog(LOG_WARNING, "failed to register signal handler %m");
+    if (frame.stream_start) {
+        stream_port.send<FormatMessage>(frame.width, frame.height, frame.codec);
     }
+    stream_port.send<FrameMessage>(data, size);
+
+    uint64_t time_after = FrameLog::get_time();
+    frame_log.log_stat("Sent frame of %zu bytes: captured in %" PRIu64 " us, "
+                       "queued for %" PRIu64 " us, written in %" PRIu64 " us",
+                       size, frame.queued - frame.capture_start,
+                       time_before - frame.queued, time_after - time_before);
 }
 
 static void usage(const char *progname)
@@ -251,106 +350,205 @@ static void usage(const char *progname)
     printf("\t--log-binary -- log binary frames (following -l)\n");
     printf("\t--log-categories -- log categories, separated by ':' (currently: frames)\n");
     printf("\t--plugins-dir=path -- change plugins directory\n");
+    printf("\t--frame-queue-depth=n -- frames waiting to be sent by a separate thread (default 2)\n");
+    printf("\t--no-frame-dropping -- send all the queued frames, even if newer ones are queued\n");
     printf("\t-d -- enable debug logs\n");
     printf("\t-c variable=value -- change settings\n");
     printf("\t\tframerate = 1-100 (check 10,20,30,40,50,60)\n");
+    printf("\t\tdamage = on|off (capture only on screen changes, default on)\n");
+    printf("\t\tcpu-limit = 0-100 (maximum CPU usage in percent of all CPUs, default 0 for none)\n");
+    printf("\t\tmin-framerate = 0-100 (frame rate for a static screen, default 0 for none)\n");
+    printf("\t\tmjpeg.NAME, gst.NAME = settings of a single plugin, see the manual page\n");
     printf("\n");
     printf("\t-h or --help     -- print this help message\n");
 
     exit(1);
 }
 
-static void
-do_capture(StreamPort &stream_port, FrameLog &frame_log, ConcreteAgent &agent)
+FrameWriter::FrameWriter(StreamPort &stream_port, FrameLog &frame_log, unsigned depth):
+    stream_port(stream_port), frame_log(frame_log), queue(depth)
 {
-    unsigned int frame_count = 0;
-    while (!quit_requested) {
-        while (!quit_requested && !streaming_requested) {
-            read_command(stream_port, true);
-        }
+    thread = std::thread(&FrameWriter::run, this);
+}
 
-        if (quit_requested) {
-            return;
-        }
+FrameWriter::~FrameWriter()
+{
+    // the frames not written yet are dropped
+    queue.close();
+    thread.join();
+    if (queue.dropped()) {
+        syslog(LOG_DEBUG, "%" PRIu64 " stale frames were dropped", queue.dropped());
+    }
+}
 
-        syslog(LOG_INFO, "streaming starts now");
-        uint64_t time_last = 0;
+void FrameWriter::push(QueuedFrame &&frame)
+{
+    if (!queue.push(std::move(frame)) && error) {
+        std::rethrow_exception(error);
+    }
+}
 
-        std::unique_ptr<FrameCapture> capture(agent.GetBestFrameCapture(client_codecs));
-        if (!capture) {
-            throw std::runtime_error("cannot find a suitable capture system");
+void FrameWriter::run()
+{
+    try {
+        QueuedFrame frame;
+        while (queue.pop(frame)) {
+            uint64_t drops = queue.dropped();
+            if (drops != drops_logged) {
+                frame_log.log_stat("Dropped %" PRIu64 " stale frames (%" PRIu64 " in total)",
+                                   drops - drops_logged, drops);
+                drops_logged = drops;
+            }
+            send_frame(stream_port, frame_log, frame, frame.buffer->data(), frame.buffer->size());
+            frame.buffer.reset();
         }
+    } catch (...) {
+        error = std::current_exception();
+        queue.close();
+    }
+}
 
-        std::vector<DeviceDisplayInfo> display_info;
-        try {
-            display_info = capture->get_device_display_info();
-        } catch (const Error &e) {
-            syslog(LOG_ERR, "Error while getting device display info: %s", e.what());
-        }
+void CaptureThread::start(const std::set<SpiceVideoCodecType> &codecs)
+{
+    if (thread.joinable()) {
+        stop();
+        restart = true;
+        restart_codecs = codecs;
+        return;
+    }
+    stopping = false;
+    thread = std::thread(&CaptureThread::run, this, codecs);
+}
 
-        syslog(LOG_DEBUG, "Got device info of %zu devices from the plugin", display_info.size());
-        for (const auto &info : display_info) {
-            syslog(LOG_DEBUG, "   stream id %u: device address: %s, device display id: %u",
-                   info.stream_id,
-                   info.device_address.c_str(),
-                   info.device_display_id);
-        }
+void CaptureThread::stop()
+{
+    restart = false;
+    if (thread.joinable()) {
+        stopping = true;
+    }
+}
 
-        if (display_info.size() > 0) {
-            if (display_info.size() > 1) {
-                syslog(LOG_WARNING, "Warning: the Frame Capture plugin returned device display "
-                       "info for more than one display device, but we currently only support "
-                       "a single device. Sending information for first device to the server.");
-            }
-            stream_port.send<DeviceDisplayInfoMessage>(display_info[0]);
-        } else {
-            syslog(LOG_ERR, "Empty device display info from the plugin");
-        }
+void CaptureThread::run(std::set<SpiceVideoCodecType> codecs)
+{
+    std::exception_ptr error;
+    try {
+        stream(codecs);
+    } catch (const WriteError &e) {
+        utils::syslog(e);
+    } catch (...) {
+        error = std::current_exception();
+    }
+    // the last thing done by the thread, so joining it does not block
+    loop.post([this, error]() {
+        finished(error);
+    });
+}
 
-        while (!quit_requested && streaming_requested) {
-            if (++frame_count % 100 == 0) {
-                syslog(LOG_DEBUG, "SENT %d frames", frame_count);
-            }
-            uint64_t time_before = FrameLog::get_time();
+void CaptureThread::finished(std::exception_ptr error)
+{
+    thread.join();
+    if (stopping) {
+        stopping = false;
+        if (restart) {
+            restart = false;
+            start(restart_codecs);
+        }
+        return;
+    }
+    if (error) {
+        // stop the agent like if the capture was running in the main thread
+        std::rethrow_exception(error);
+    }
+    // the streaming was interrupted by a write error, try again
+    start(client_codecs);
+}
 
-            frame_log.log_stat("Capturing frame...");
-            FrameInfo frame = capture->CaptureFrame();
-            frame_log.log_stat("Captured frame");
+void CaptureThread::stream(const std::set<SpiceVideoCodecType> &codecs)
+{
+    syslog(LOG_INFO, "streaming starts now");
+    uint64_t time_last = 0;
 
-            uint64_t time_after = FrameLog::get_time();
-            syslog(LOG_DEBUG,
-                   "got a frame -- size is %zu (%" PRIu64 " ms) "
-                   "(%" PRIu64 " ms from last frame)(%" PRIu64 " us)\n",
-                   frame.buffer_size, (time_after - time_before)/1000,
-                   (time_after - time_last)/1000,
-                   (time_before - time_last));
-            time_last = time_after;
+    std::unique_ptr<FrameCapture> capture(agent.GetBestFrameCapture(codecs));
+    if (!capture) {
+        throw std::runtime_error("cannot find a suitable capture system");
+    }
 
-            if (frame.stream_start) {
-                unsigned width, height;
-                unsigned char codec;
+    std::vector<DeviceDisplayInfo> display_info;
+    try {
+        display_info = capture->get_device_display_info();
+    } catch (const Error &e) {
+        syslog(LOG_ERR, "Error while getting device display info: %s", e.what());
+    }
 
-                width = frame.size.width;
-                height = frame.size.height;
-                codec = capture->VideoCodecType();
+    syslog(LOG_DEBUG, "Got device info of %zu devices from the plugin", display_info.size());
+    for (const auto &info : display_info) {
+        syslog(LOG_DEBUG, "   stream id %u: device address: %s, device display id: %u",
+               info.stream_id,
+               info.device_address.c_str(),
+               info.device_display_id);
+    }
 
-                syslog(LOG_DEBUG, "wXh %uX%u  codec=%u", width, height, codec);
-                frame_log.log_stat("Started new stream wXh %uX%u codec=%u", width, height, codec);
+    if (display_info.size() > 0) {
+        if (display_info.size() > 1) {
+            syslog(LOG_WARNING, "Warning: the Frame Capture plugin returned device display "
+                   "info for more than one display device, but we currently only support "
+                   "a single device. Sending information for first device to the server.");
+        }
+        stream_port.send<DeviceDisplayInfoMessage>(display_info[0]);
+    } else {
+        syslog(LOG_ERR, "Empty device display info from the plugin");
+    }
 
-                stream_port.send<FormatMessage>(width, height, codec);
-            }
-            frame_log.log_stat("Frame of %zu bytes", frame.buffer_size);
-            frame_log.log_frame(frame.buffer, frame.buffer_size);
-
-            try {
-                stream_port.send<FrameMessage>(frame.buffer, frame.buffer_size);
-            } catch (const WriteError& e) {
-                utils::syslog(e);
-                break;
-            }
-            frame_log.log_stat("Sent frame");
+    std::unique_ptr<FrameWriter> writer;
+    if (queue_depth > 0) {
+        writer.reset(new FrameWriter(stream_port, frame_log, queue_depth));
+    }
 
-            read_command(stream_port, false);
+    while (!stopping) {
+        if (++frame_count % 100 == 0) {
+            syslog(LOG_DEBUG, "SENT %d frames", frame_count);
+        }
+        uint64_t time_before = FrameLog::get_time();
+
+        frame_log.log_stat("Capturing frame...");
+        FrameInfo frame = capture->CaptureFrame();
+        frame_log.log_stat("Captured frame");
+
+        uint64_t time_after = FrameLog::get_time();
+        syslog(LOG_DEBUG,
+               "got a frame -- size is %zu (%" PRIu64 " ms) "
+               "(%" PRIu64 " ms from last frame)(%" PRIu64 " us)\n",
+               frame.buffer_size, (time_after - time_before)/1000,
+               (time_after - time_last)/1000,
+               (time_before - time_last));
+        time_last = time_after;
+
+        QueuedFrame queued;
+        queued.width = frame.size.width;
+        queued.height = frame.size.height;
+        queued.codec = capture->VideoCodecType();
+        queued.stream_start = frame.stream_start;
+        // the plugins do not tell which frames of other codecs are key frames
+        queued.droppable = drop_frames && !frame.stream_start &&
+                           queued.codec == SPICE_VIDEO_CODEC_TYPE_MJPEG;
+        queued.capture_start = time_before;
+        queued.queued = time_after;
+
+        if (frame.stream_start) {
+            syslog(LOG_DEBUG, "wXh %uX%u  codec=%u", queued.width, queued.height, queued.codec);
+            frame_log.log_stat("Started new stream wXh %uX%u codec=%u",
+                               queued.width, queued.height, queued.codec);
+        }
+        frame_log.log_stat("Frame of %zu bytes", frame.buffer_size);
+        frame_log.log_frame(frame.buffer, frame.buffer_size);
+
+        if (writer) {
+            // the frame is only valid until the next capture
+            queued.buffer = buffers.get();
+            queued.buffer->append(static_cast<const uint8_t *>(frame.buffer), frame.buffer_size);
+            writer->push(std::move(queued));
+        } else {
+            send_frame(stream_port, frame_log, queued, frame.buffer, frame.buffer_size);
         }
     }
 }
@@ -362,17 +560,23 @@ int main(int argc, char* argv[])
     const char *log_filename = NULL;
     bool log_binary = false;
     bool log_frames = false;
+    unsigned frame_queue_depth = 2;
+    bool drop_frames = true;
     const char *pluginsdir = PLUGINSDIR;
     enum {
         OPT_first = UCHAR_MAX,
         OPT_PLUGINS_DIR,
         OPT_LOG_BINARY,
         OPT_LOG_CATEGORIES,
+        OPT_FRAME_QUEUE_DEPTH,
+        OPT_NO_FRAME_DROPPING,
     };
     static const struct option long_options[] = {
         { "plugins-dir", required_argument, NULL, OPT_PLUGINS_DIR},
         { "log-binary", no_argument, NULL, OPT_LOG_BINARY},
         { "log-categories", required_argument, NULL, OPT_LOG_CATEGORIES},
+        { "frame-queue-depth", required_argument, NULL, OPT_FRAME_QUEUE_DEPTH},
+        { "no-frame-dropping", no_argument, NULL, OPT_NO_FRAME_DROPPING},
         { "help", no_argument, NULL, 'h'},
         { 0, 0, 0, 0}
     };
@@ -418,6 +622,19 @@ int main(int argc, char* argv[])
                 // ignore not existing, compatibility for future
             }
             break;
+        case OPT_FRAME_QUEUE_DEPTH: {
+            char *end;
+            long depth = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || depth < 0 || depth > 64) {
+                syslog(LOG_ERR, "Invalid '--frame-queue-depth' argument value: %s", optarg);
+                usage(argv[0]);
+            }
+            frame_queue_depth = depth;
+            break;
+        }
+        case OPT_NO_FRAME_DROPPING:
+            drop_frames = false;
+            break;
         case 'l':
             log_filename = optarg;
             break;
@@ -430,9 +647,14 @@ int main(int argc, char* argv[])
         }
     }
 
-    register_interrupts();
-
     try {
+        // before starting any thread, so the signals are blocked in all of them
+        EventLoop loop;
+        loop.add_signals({SIGINT, SIGTERM}, [&loop](int signal) {
+            syslog(LOG_INFO, "Got signal %d, exiting", signal);
+            loop.quit();
+        });
+
         FrameLog frame_log(log_filename, log_binary, log_frames);
 
         ConcreteAgent agent(options, &frame_log);
@@ -448,10 +670,19 @@ int main(int argc, char* argv[])
         old_args.clear();
 
         StreamPort stream_port(stream_port_name);
+        agent.SetStreamPort(&stream_port);
+
+        CursorUpdater cursor_updater(&stream_port, loop); // can live only while stream_port is alive !
+
+        CaptureThread capture(stream_port, frame_log, agent, loop,
+                              frame_queue_depth, drop_frames);
 
-        CursorUpdater running_cursor_thread(&stream_port); // can live only while stream_port is alive !
+        int port_retry_timer = loop.add_timer([&]() {
+            watch_stream_port(loop, stream_port, capture, port_retry_timer);
+        });
+        watch_stream_port(loop, stream_port, capture, port_retry_timer);
 
-        do_capture(stream_port, frame_log, agent);
+        loop.run();
     }
     catch (std::exception &err) {
         syslog(LOG_ERR, "%s", err.what());
@@ -5,13 +5,17 @@
  */
 
 #include "stream-port.hpp"
+#include "utils.hpp"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <algorithm>
 #include <stdexcept>
 
 #include <common/utils.h>
@@ -99,43 +103,212 @@ NotifyErrorMessage InboundMessage::get_payload<NotifyErrorMessage>()
     return msg;
 }
 
-StreamPort::StreamPort(const std::string &port_name) : fd(open(port_name.c_str(), O_RDWR | O_NONBLOCK))
+StreamPort::StreamPort(const std::string &port_name) :
+    fd(open(port_name.c_str(), O_RDWR | O_NONBLOCK)),
+    interrupt_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
 {
     if (fd < 0) {
-        throw IOError("Failed to open the streaming device \"" + port_name + "\"", errno);
+        int error = errno;
+        if (interrupt_fd >= 0) {
+            close(interrupt_fd);
+        }
+        throw IOError("Failed to open the streaming device \"" + port_name + "\"", error);
+    }
+    if (interrupt_fd < 0) {
+        int error = errno;
+        close(fd);
+        throw IOError("Failed to create an eventfd", error);
     }
 }
 
 StreamPort::~StreamPort()
 {
+    close(interrupt_fd);
     close(fd);
 }
 
-InboundMessage StreamPort::receive()
+namespace {
+
+/* Read the missing bytes of buf without blocking, returns whether it is complete */
+bool read_available(int fd, void *buf, size_t len, size_t &received)
+{
+    while (received < len) {
+        ssize_t n = read(fd, (uint8_t *) buf + received, len - received);
+
+        if (n == 0) {
+            throw ReadError("Reading message from device failed: read() returned 0, device is closed.");
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            throw ReadError("Reading message from device failed", errno);
+        }
+
+        received += n;
+    }
+    return true;
+}
+
+}
+
+std::unique_ptr<InboundMessage> StreamPort::receive()
 {
-    std::lock_guard<std::mutex> stream_guard(mutex);
+    std::lock_guard<std::mutex> stream_guard(read_mutex);
 
-    StreamDevHeader header;
-    read_all(fd, &header, sizeof(header));
+    if (!in_data) {
+        if (!read_available(fd, &in_header, sizeof(in_header), in_received)) {
+            return nullptr;
+        }
+        in_received = 0;
+
+        if (in_header.protocol_version != STREAM_DEVICE_PROTOCOL) {
+            throw std::runtime_error("Bad protocol version: " +
+                                     std::to_string(in_header.protocol_version) +
+                                     ", expected: " + std::to_string(STREAM_DEVICE_PROTOCOL));
+        }
 
-    if (header.protocol_version != STREAM_DEVICE_PROTOCOL) {
-        throw std::runtime_error("Bad protocol version: " + std::to_string(header.protocol_version) +
-                                 ", expected: " + std::to_string(STREAM_DEVICE_PROTOCOL));
+        if (in_header.size > 4 * 1024) {  // a 4kB generic limit of the message size
+            throw std::runtime_error("Inbound message too big, exceeding the 4kB limit.");
+        }
+
+        in_data.reset(new uint8_t[in_header.size]);
     }
 
-    if (header.size > 4 * 1024) {  // a 4kB generic limit of the message size
-        throw std::runtime_error("Inbound message too big, exceeding the 4kB limit.");
+    if (!read_available(fd, in_data.get(), in_header.size, in_received)) {
+        return nullptr;
     }
+    in_received = 0;
+
+    return std::unique_ptr<InboundMessage>(new InboundMessage(in_header, std::move(in_data)));
+}
 
-    std::unique_ptr<uint8_t[]> data(new uint8_t[header.size]);
-    read_all(fd, data.get(), header.size);
+namespace {
+
+/* Releases a lock for the lifetime of the object */
+class Unlocker
+{
+public:
+    Unlocker(std::unique_lock<std::mutex> &lock): lock(lock)
+    {
+        lock.unlock();
+    }
+    ~Unlocker()
+    {
+        lock.lock();
+    }
+private:
+    std::unique_lock<std::mutex> &lock;
+};
 
-    return InboundMessage(header, std::move(data));
 }
 
-void StreamPort::write(const void *buf, size_t len)
+void StreamPort::write_message(const IoVector &iov)
 {
-    write_all(fd, buf, len);
+    std::unique_lock<std::mutex> lock(mutex);
+    writer_cond.wait(lock, [this] { return !writing; });
+    writing = true;
+
+    try {
+        flush_urgent(lock);
+        {
+            // the lock is released so other threads can queue urgent
+            // messages, they are sent once the message is complete
+            Unlocker unlocker(lock);
+            IoVector parts = iov;
+            write_counted(parts.parts, parts.count);
+        }
+        ++messages_sent;
+        flush_urgent(lock);
+    } catch (...) {
+        writing = false;
+        writer_cond.notify_one();
+        throw;
+    }
+
+    writing = false;
+    writer_cond.notify_one();
+}
+
+void StreamPort::post_message(const IoVector &iov)
+{
+    std::vector<uint8_t> message;
+    for (unsigned i = 0; i < iov.count; ++i) {
+        const uint8_t *part = static_cast<const uint8_t *>(iov.parts[i].iov_base);
+        message.insert(message.end(), part, part + iov.parts[i].iov_len);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    urgent.push_back(std::move(message));
+    if (writing) {
+        // the writing thread sends it at the end of its message
+        return;
+    }
+    writing = true;
+
+    try {
+        flush_urgent(lock);
+    } catch (...) {
+        writing = false;
+        writer_cond.notify_one();
+        throw;
+    }
+
+    writing = false;
+    writer_cond.notify_one();
+}
+
+void StreamPort::flush_urgent(std::unique_lock<std::mutex> &lock)
+{
+    while (!urgent.empty()) {
+        std::vector<uint8_t> message = std::move(urgent.front());
+        urgent.pop_front();
+
+        Unlocker unlocker(lock);
+        iovec iov = { message.data(), message.size() };
+        write_counted(&iov, 1);
+        ++messages_sent;
+    }
+}
+
+void StreamPort::write_counted(iovec *iov, unsigned count)
+{
+    size_t size = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        size += iov[i].iov_len;
+    }
+
+    uint64_t start = utils::get_time();
+    try {
+        writev_all(fd, iov, count, interrupt_fd);
+    } catch (...) {
+        write_time += utils::get_time() - start;
+        throw;
+    }
+    write_time += utils::get_time() - start;
+    bytes_sent += size;
+}
+
+void StreamPort::interrupt()
+{
+    // only fails if the counter overflows, in which case it is readable
+    uint64_t value = 1;
+    if (::write(interrupt_fd, &value, sizeof(value)) < 0) {
+        syslog(LOG_DEBUG, "Cannot write to the eventfd: %s", strerror(errno));
+    }
+}
+
+TransportStats StreamPort::stats() const
+{
+    TransportStats stats;
+    stats.bytes_sent = bytes_sent;
+    stats.messages_sent = messages_sent;
+    stats.write_time = write_time;
+    return stats;
 }
 
 void read_all(int fd, void *buf, size_t len)
@@ -179,13 +352,23 @@ void read_all(int fd, void *buf, size_t len)
 
 void write_all(int fd, const void *buf, size_t len)
 {
-    while (len > 0) {
-        ssize_t n = write(fd, buf, len);
+    iovec iov = { const_cast<void *>(buf), len };
+    writev_all(fd, &iov, 1);
+}
+
+void writev_all(int fd, iovec *iov, unsigned count, int interrupt_fd)
+{
+    iovec *next = iov;
+
+    while (count > 0) {
+        ssize_t n = ::writev(fd, next, std::min(count, (unsigned) IOV_MAX));
 
         if (n < 0) {
             if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
-                struct pollfd pollfd = {fd, POLLOUT, 0};
-                if (poll(&pollfd, 1, -1) < 0) {
+                // a negative interrupt_fd is ignored by poll()
+                struct pollfd pollfds[2] = {{fd, POLLOUT, 0}, {interrupt_fd, POLLIN, 0}};
+                struct pollfd &pollfd = pollfds[0];
+                if (poll(pollfds, 2, -1) < 0) {
                     if (errno == EINTR) {
                         continue;
                     }
@@ -193,6 +376,10 @@ void write_all(int fd, const void *buf, size_t len)
                     throw WriteError("poll failed while writing message to device", errno);
                 }
 
+                if (pollfds[1].revents & POLLIN) {
+                    throw WriteError("Writing message to device interrupted");
+                }
+
                 if (pollfd.revents & POLLOUT) {
                     continue;
                 }
@@ -207,8 +394,16 @@ void write_all(int fd, const void *buf, size_t len)
             throw WriteError("Writing message to device failed", errno);
         }
 
-        len -= n;
-        buf = (uint8_t *) buf + n;
+        // skip the buffers written completely, then the written part of the next one
+        while (count > 0 && (size_t) n >= next->iov_len) {
+            n -= next->iov_len;
+            ++next;
+            --count;
+        }
+        if (count > 0) {
+            next->iov_base = (uint8_t *) next->iov_base + n;
+            next->iov_len -= n;
+        }
     }
 }
 
@@ -10,13 +10,19 @@
 #include <spice/enums.h>
 
 #include <spice-streaming-agent/error.hpp>
+#include <spice-streaming-agent/transport-monitor.hpp>
 
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
 #include <cstddef>
+#include <deque>
 #include <string>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <vector>
+#include <sys/uio.h>
 
 
 namespace spice {
@@ -80,28 +86,107 @@ InCapabilitiesMessage InboundMessage::get_payload<InCapabilitiesMessage>();
 template<>
 NotifyErrorMessage InboundMessage::get_payload<NotifyErrorMessage>();
 
+/*!
+ * The parts of an outbound message, to be written with a single writev().
+ * The buffers must stay valid until the message is sent.
+ */
+class IoVector
+{
+public:
+    static constexpr unsigned max_parts = 4;
+
+    void add(const void *buf, size_t len)
+    {
+        if (len == 0) {
+            return;
+        }
+        assert(count < max_parts);
+        parts[count].iov_base = const_cast<void *>(buf);
+        parts[count].iov_len = len;
+        ++count;
+    }
+
+    iovec parts[max_parts];
+    unsigned count = 0;
+};
+
 class StreamPort {
 public:
     StreamPort(const std::string &port_name);
     ~StreamPort();
 
-    InboundMessage receive();
+    /*!
+     * Read the next message without blocking. The bytes available are kept
+     * until the message is complete, nullptr is returned until then.
+     */
+    std::unique_ptr<InboundMessage> receive();
 
+    /*!
+     * Send a message, waiting for the messages being written by other
+     * threads.
+     */
     template <typename Message, typename ...PayloadArgs>
     void send(PayloadArgs&&... payload_args)
     {
         Message message(payload_args...);
-        std::lock_guard<std::mutex> stream_guard(mutex);
-        message.write_header(*this);
-        message.write_message_body(*this, payload_args...);
+        IoVector iov;
+        message.collect_header(iov);
+        message.collect_body(iov, payload_args...);
+
+        write_message(iov);
     }
 
-    void write(const void *buf, size_t len);
+    /*!
+     * Send an urgent message, like a cursor update, before the messages
+     * which are not started yet. If another thread is writing a message
+     * the urgent one is queued and sent by that thread as soon as its
+     * message is complete: messages cannot be interleaved on the port.
+     */
+    template <typename Message, typename ...PayloadArgs>
+    void post(PayloadArgs&&... payload_args)
+    {
+        Message message(payload_args...);
+        IoVector iov;
+        message.collect_header(iov);
+        message.collect_body(iov, payload_args...);
+
+        post_message(iov);
+    }
+
+    /*!
+     * Make the writes waiting for room on the port, and the ones which
+     * would wait later, fail with a WriteError, so the threads writing
+     * can be joined when the agent exits.
+     */
+    void interrupt();
+
+    /*! Counters of the data written, thread safe */
+    TransportStats stats() const;
 
     const int fd;
 
 private:
+    void write_message(const IoVector &iov);
+    void post_message(const IoVector &iov);
+    void flush_urgent(std::unique_lock<std::mutex> &lock);
+    void write_counted(iovec *iov, unsigned count);
+
+    // readable once the writes are interrupted
+    const int interrupt_fd;
+    std::mutex read_mutex;
+    // protected by read_mutex, the message being received
+    StreamDevHeader in_header;
+    std::unique_ptr<uint8_t[]> in_data;
+    // bytes of the header, or of the data once in_data is set, received
+    size_t in_received = 0;
+    // protects the fields below, not held while writing
     std::mutex mutex;
+    std::condition_variable writer_cond;
+    // whether a thread is writing messages
+    bool writing = false;
+    std::deque<std::vector<uint8_t>> urgent;
+
+    std::atomic<uint64_t> bytes_sent{0}, messages_sent{0}, write_time{0};
 };
 
 template <typename Payload, typename Message, unsigned Type>
@@ -116,9 +201,9 @@ public:
         hdr.size = (uint32_t) Message::size(payload_args...);
     }
 
-    void write_header(StreamPort &stream_port)
+    void collect_header(IoVector &iov)
     {
-        stream_port.write(&hdr, sizeof(hdr));
+        iov.add(&hdr, sizeof(hdr));
     }
 
 protected:
@@ -128,5 +213,11 @@ protected:
 
 void read_all(int fd, void *buf, size_t len);
 void write_all(int fd, const void *buf, size_t len);
+/*!
+ * Write all the buffers of iov, in as few writev() calls as possible.
+ * The entries of iov are updated to track partial writes. If interrupt_fd
+ * becomes readable while waiting for room a WriteError is thrown.
+ */
+void writev_all(int fd, iovec *iov, unsigned count, int interrupt_fd = -1);
 
 }} // namespace spice::streaming_agent
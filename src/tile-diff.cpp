@@ -0,0 +1,181 @@
+/* Detection of the changed areas between two frames.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "tile-diff.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TILE_DIFF_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+bool equal_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    uint64_t diff = 0;
+
+    for (; len >= 8; len -= 8, a += 8, b += 8) {
+        uint64_t va, vb;
+        memcpy(&va, a, 8);
+        memcpy(&vb, b, 8);
+        diff |= va ^ vb;
+    }
+    for (; len > 0; --len) {
+        diff |= *a++ ^ *b++;
+    }
+    return diff == 0;
+}
+
+#if TILE_DIFF_X86
+__attribute__((target("sse2")))
+bool equal_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    __m128i diff = _mm_setzero_si128();
+
+    for (; len >= 16; len -= 16, a += 16, b += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+        diff = _mm_or_si128(diff, _mm_xor_si128(va, vb));
+    }
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff) {
+        return false;
+    }
+    return equal_scalar(a, b, len);
+}
+
+__attribute__((target("avx2")))
+bool equal_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+    __m256i diff = _mm256_setzero_si256();
+
+    for (; len >= 32; len -= 32, a += 32, b += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b));
+        diff = _mm256_or_si256(diff, _mm256_xor_si256(va, vb));
+    }
+    if (!_mm256_testz_si256(diff, diff)) {
+        return false;
+    }
+    return equal_scalar(a, b, len);
+}
+#endif
+
+}
+
+constexpr unsigned TileDiff::tile_width;
+constexpr unsigned TileDiff::tile_height;
+
+TileDiff::TileDiff() :
+    equal(equal_scalar)
+{
+#if TILE_DIFF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        equal = equal_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        equal = equal_sse2;
+    }
+#endif
+}
+
+void TileDiff::resize(unsigned width, unsigned height)
+{
+    tiles_x = (width + tile_width - 1) / tile_width;
+    tiles_y = (height + tile_height - 1) / tile_height;
+    changed.assign(tiles_x * tiles_y, 0);
+    changed_count = 0;
+}
+
+void TileDiff::mark_all(unsigned width, unsigned height)
+{
+    resize(width, height);
+    std::fill(changed.begin(), changed.end(), 1);
+    changed_count = changed.size();
+}
+
+void TileDiff::clear(unsigned width, unsigned height)
+{
+    resize(width, height);
+}
+
+unsigned TileDiff::copy_rect(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride,
+                             unsigned x, unsigned y, unsigned width, unsigned height)
+{
+    unsigned count = 0;
+    const unsigned tx_begin = x / tile_width;
+    const unsigned tx_end = (x + width + tile_width - 1) / tile_width;
+
+    for (unsigned line = 0; line < height; ++line, src += src_stride) {
+        uint8_t *dst_line = dst + (y + line) * dst_stride + x * 4;
+        uint8_t *row_changed = &changed[(y + line) / tile_height * tiles_x];
+
+        for (unsigned tx = tx_begin; tx < tx_end; ++tx) {
+            if (row_changed[tx]) {
+                continue;
+            }
+            const unsigned begin = std::max(tx * tile_width, x) - x;
+            const unsigned end = std::min((tx + 1) * tile_width, x + width) - x;
+            if (!equal(dst_line + begin * 4, src + begin * 4, (end - begin) * 4)) {
+                row_changed[tx] = 1;
+                ++count;
+            }
+        }
+        memcpy(dst_line, src, width * 4);
+    }
+
+    changed_count += count;
+    return count;
+}
+
+unsigned TileDiff::compare(const uint8_t *prev, const uint8_t *cur,
+                           unsigned width, unsigned height, size_t stride)
+{
+    unsigned count = 0;
+
+    resize(width, height);
+
+    for (unsigned ty = 0; ty < tiles_y; ++ty) {
+        uint8_t *row_changed = &changed[ty * tiles_x];
+        const unsigned y_end = std::min((ty + 1) * tile_height, height);
+
+        // go through the tile row line by line, skipping the tiles already
+        // found changed, to read the memory sequentially
+        for (unsigned y = ty * tile_height; y < y_end; ++y) {
+            const uint8_t *prev_line = prev + y * stride;
+            const uint8_t *cur_line = cur + y * stride;
+
+            for (unsigned tx = 0; tx < tiles_x; ++tx) {
+                if (row_changed[tx]) {
+                    continue;
+                }
+                const unsigned x = tx * tile_width;
+                const size_t len = std::min(tile_width, width - x) * 4;
+                if (!equal(prev_line + x * 4, cur_line + x * 4, len)) {
+                    row_changed[tx] = 1;
+                    ++count;
+                }
+            }
+        }
+    }
+
+    changed_count = count;
+    return count;
+}
+
+bool TileDiff::row_changed(unsigned y) const
+{
+    auto begin = changed.begin() + y * tiles_x;
+    return std::find(begin, begin + tiles_x, 1) != begin + tiles_x;
+}
+
+}} // namespace spice::streaming_agent
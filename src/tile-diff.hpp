@@ -0,0 +1,103 @@
+/* Detection of the changed areas between two frames.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Compares two 32 bit per pixel frames tile by tile and keeps a bitmap of
+ * the tiles which changed.
+ *
+ * The tiles are as high as a JPEG MCU row (with 4:2:0 subsampling) so that
+ * the bitmap can be used directly by the JPEG encoding stages.
+ * The comparison uses AVX2 or SSE2 when the CPU supports them.
+ */
+class TileDiff
+{
+public:
+    static constexpr unsigned tile_width = 64;
+    static constexpr unsigned tile_height = 16;
+
+    TileDiff();
+
+    /*!
+     * Compare two frames of the same size and layout.
+     * \return the number of tiles which differ
+     */
+    unsigned compare(const uint8_t *prev, const uint8_t *cur,
+                     unsigned width, unsigned height, size_t stride);
+
+    /*!
+     * Mark the whole frame as changed, for instance when there is no
+     * previous frame to compare with.
+     */
+    void mark_all(unsigned width, unsigned height);
+
+    /*!
+     * Mark the whole frame as unchanged, to start updating it with
+     * copy_rect().
+     */
+    void clear(unsigned width, unsigned height);
+
+    /*!
+     * Copy a rectangle into a frame, marking the tiles where the copied
+     * pixels differ from the ones they replace.
+     * \param dst the frame, of the size given to clear()
+     * \param src the top left pixel of the rectangle to copy
+     * \return the number of tiles newly marked as changed
+     */
+    unsigned copy_rect(uint8_t *dst, size_t dst_stride, const uint8_t *src, size_t src_stride,
+                       unsigned x, unsigned y, unsigned width, unsigned height);
+
+    /*! Number of changed tiles */
+    unsigned count() const
+    {
+        return changed_count;
+    }
+
+    /*! Number of tile columns of the last compared frame */
+    unsigned columns() const
+    {
+        return tiles_x;
+    }
+
+    /*! Number of tile rows of the last compared frame */
+    unsigned rows() const
+    {
+        return tiles_y;
+    }
+
+    bool tile_changed(unsigned x, unsigned y) const
+    {
+        return changed[y * tiles_x + x];
+    }
+
+    /*! Whether any tile of the tile row y changed */
+    bool row_changed(unsigned y) const;
+
+    /*! One byte per tile, row major, non-zero if the tile changed */
+    const std::vector<uint8_t> &changed_tiles() const
+    {
+        return changed;
+    }
+
+private:
+    void resize(unsigned width, unsigned height);
+
+    unsigned tiles_x = 0, tiles_y = 0;
+    std::vector<uint8_t> changed;
+    unsigned changed_count = 0;
+    bool (*equal)(const uint8_t *a, const uint8_t *b, size_t len);
+};
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,83 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "bitrate-controller.hpp"
+
+namespace ssa = spice::streaming_agent;
+
+
+SCENARIO("test adapting the bitrate", "[bitrate]") {
+    GIVEN("A controller between 500 kbit/s and 8 Mbit/s at 10 fps") {
+        ssa::BitrateController::Settings settings;
+        settings.max_bitrate = 8000000;
+        settings.min_bitrate = 500000;
+        settings.max_latency = 200000000;
+        ssa::BitrateController controller(settings);
+        const uint64_t interval = 100000000;
+        uint64_t now = interval;
+        ssa::TransportStats stats{};
+
+        REQUIRE(controller.bitrate() == 8000000);
+
+        WHEN("the port drains 2 Mbit/s and the writes block all the time") {
+            unsigned changes = 0;
+            for (unsigned i = 0; i < 20; ++i, now += interval) {
+                stats.bytes_sent += 25000;
+                stats.write_time += interval;
+                changes += controller.update(now, 25000, stats);
+            }
+
+            THEN("the bitrate goes below the drain rate quickly") {
+                CHECK(changes >= 1);
+                CHECK(controller.drain_rate() == 2000000);
+                CHECK(controller.bitrate() <= 1500000);
+                CHECK(controller.bitrate() >= 500000);
+            }
+        }
+
+        WHEN("the port stays congested") {
+            for (unsigned i = 0; i < 200; ++i, now += interval) {
+                stats.bytes_sent += 1000;
+                stats.write_time += interval;
+                controller.update(now, 1000, stats);
+            }
+
+            THEN("the bitrate stops at the minimum") {
+                CHECK(controller.bitrate() == 500000);
+            }
+        }
+
+        WHEN("the port is congested, then idle") {
+            for (unsigned i = 0; i < 20; ++i, now += interval) {
+                stats.bytes_sent += 25000;
+                stats.write_time += interval;
+                controller.update(now, 25000, stats);
+            }
+            uint64_t lowered = controller.bitrate();
+            for (unsigned i = 0; i < 300; ++i, now += interval) {
+                stats.bytes_sent += 25000;
+                stats.write_time += interval / 100;
+                controller.update(now, 25000, stats);
+            }
+
+            THEN("the bitrate is raised again") {
+                CHECK(controller.bitrate() > lowered);
+                CHECK(controller.busy() < 50);
+            }
+        }
+
+        WHEN("the port keeps up easily") {
+            unsigned changes = 0;
+            for (unsigned i = 0; i < 100; ++i, now += interval) {
+                stats.bytes_sent += 100000;
+                stats.write_time += interval / 10;
+                changes += controller.update(now, 100000, stats);
+            }
+
+            THEN("the bitrate is kept at the maximum") {
+                CHECK(changes == 0);
+                CHECK(controller.bitrate() == 8000000);
+            }
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "change-rate.hpp"
+
+namespace ssa = spice::streaming_agent;
+
+
+SCENARIO("test adapting the frame rate to the changes", "[change-rate]") {
+    GIVEN("A controller between 2 and 30 fps") {
+        ssa::ChangeRateController::Settings settings;
+        settings.min_fps = 2;
+        settings.max_fps = 30;
+        settings.full_change = 100;
+        ssa::ChangeRateController controller(settings);
+        const unsigned total = 1000;
+
+        REQUIRE(controller.enabled());
+        REQUIRE(controller.fps() == 30);
+
+        WHEN("the screen does not change") {
+            for (unsigned i = 0; i < 100; ++i) {
+                controller.update(0, total);
+            }
+
+            THEN("the frame rate goes down to the floor") {
+                CHECK(controller.fps() == 2);
+                CHECK(controller.change_ratio() == 0);
+            }
+        }
+
+        WHEN("a video starts on a static screen") {
+            for (unsigned i = 0; i < 100; ++i) {
+                controller.update(0, total);
+            }
+            bool changed = controller.update(300, total);
+
+            THEN("the full frame rate is used at once") {
+                CHECK(changed);
+                CHECK(controller.fps() == 30);
+                CHECK(controller.change_ratio() == 300);
+            }
+        }
+
+        WHEN("a small part of the screen changes") {
+            for (unsigned i = 0; i < 100; ++i) {
+                controller.update(50, total);
+            }
+
+            THEN("the frame rate is in between") {
+                CHECK(controller.fps() > 2);
+                CHECK(controller.fps() < 30);
+            }
+        }
+
+        WHEN("the changes stop for a couple of frames") {
+            controller.update(300, total);
+            unsigned changes = 0;
+            for (unsigned i = 0; i < 3; ++i) {
+                changes += controller.update(0, total);
+            }
+
+            THEN("the frame rate is kept") {
+                CHECK(changes == 0);
+                CHECK(controller.fps() == 30);
+            }
+        }
+    }
+
+    GIVEN("A controller without a floor") {
+        ssa::ChangeRateController::Settings settings;
+        settings.max_fps = 30;
+        ssa::ChangeRateController controller(settings);
+
+        THEN("the frame rate is not adapted") {
+            CHECK(!controller.enabled());
+            CHECK(!controller.update(0, 1000));
+            CHECK(controller.fps() == 30);
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "color-convert.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace ssa = spice::streaming_agent;
+
+
+static int reference_luma(const uint8_t *p)
+{
+    return lround(0.299 * p[2] + 0.587 * p[1] + 0.114 * p[0]);
+}
+
+SCENARIO("test converting BGRX images to YCbCr", "[color]") {
+    GIVEN("A random image with a padded stride and a size not multiple of 16") {
+        const unsigned width = 1283, height = 37;
+        const size_t stride = width * 4 + 12;
+        std::vector<uint8_t> image(stride * height);
+        for (auto &byte : image) {
+            byte = rand();
+        }
+        ssa::YCbCrImage ycbcr;
+        ycbcr.resize(width, height);
+
+        WHEN("converting the image") {
+            ssa::bgrx_to_ycbcr420(image.data(), stride, ycbcr);
+
+            THEN("the planes are padded to whole macroblocks") {
+                CHECK(ycbcr.padded_width == 1296);
+                CHECK(ycbcr.padded_height == 48);
+                CHECK(ycbcr.y.size() == 1296 * 48);
+                CHECK(ycbcr.cb.size() == 648 * 24);
+            }
+
+            THEN("the luma matches the JFIF formula") {
+                int max_error = 0;
+                for (unsigned y = 0; y < height; ++y) {
+                    for (unsigned x = 0; x < width; ++x) {
+                        int error = ycbcr.y_row(y)[x] - reference_luma(&image[y * stride + x * 4]);
+                        max_error = std::max(max_error, std::abs(error));
+                    }
+                }
+                CHECK(max_error <= 1);
+            }
+
+            THEN("the chroma is the one of the average of 2x2 pixels") {
+                const uint8_t *p = &image[2 * stride + 4 * 4];
+                double b = 0, g = 0, r = 0;
+                for (const uint8_t *q : { p, p + 4, p + stride, p + stride + 4 }) {
+                    b += q[0] / 4.0;
+                    g += q[1] / 4.0;
+                    r += q[2] / 4.0;
+                }
+                CHECK(std::abs(ycbcr.cb_row(1)[2] - (128 - 0.168736 * r - 0.331264 * g + 0.5 * b)) <= 1);
+                CHECK(std::abs(ycbcr.cr_row(1)[2] - (128 + 0.5 * r - 0.418688 * g - 0.081312 * b)) <= 1);
+            }
+
+            THEN("the padding replicates the last column and row") {
+                CHECK(ycbcr.y_row(10)[1295] == ycbcr.y_row(10)[1282]);
+                CHECK(ycbcr.y_row(47)[100] == ycbcr.y_row(36)[100]);
+                CHECK(ycbcr.y_row(47)[1295] == ycbcr.y_row(36)[1282]);
+            }
+        }
+
+        WHEN("converting the image in two parts") {
+            ssa::YCbCrImage whole;
+            whole.resize(width, height);
+            ssa::bgrx_to_ycbcr420(image.data(), stride, whole);
+            ssa::bgrx_to_ycbcr420(image.data(), stride, ycbcr, 0, 16);
+            ssa::bgrx_to_ycbcr420(image.data(), stride, ycbcr, 16);
+
+            THEN("the result is the same") {
+                CHECK(ycbcr.y == whole.y);
+                CHECK(ycbcr.cb == whole.cb);
+                CHECK(ycbcr.cr == whole.cr);
+            }
+        }
+    }
+}
@@ -0,0 +1,87 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "cpu-governor.hpp"
+
+namespace ssa = spice::streaming_agent;
+
+
+SCENARIO("test limiting the CPU usage", "[cpu]") {
+    GIVEN("A governor limiting to 25% of 2 CPUs at 20 fps") {
+        ssa::CpuGovernor::Settings settings;
+        settings.max_cpu = 25;
+        settings.cpus = 2;
+        settings.max_fps = 20;
+        settings.max_quality = 80;
+        settings.min_quality = 40;
+        ssa::CpuGovernor governor(settings);
+        const uint64_t second = 1000000000;
+        uint64_t now = second, cpu_time = 0;
+        governor.update(now, cpu_time);
+
+        WHEN("the process uses a whole CPU") {
+            unsigned changes = 0;
+            for (unsigned i = 0; i < 20; ++i) {
+                now += second;
+                cpu_time += second;
+                changes += governor.update(now, cpu_time);
+            }
+
+            THEN("the frame rate and the quality are lowered") {
+                CHECK(governor.usage() == 50);
+                CHECK(changes > 0);
+                CHECK(governor.fps() < 10);
+                CHECK(governor.quality() == 40);
+            }
+        }
+
+        WHEN("the usage is measured before the end of the period") {
+            now += second / 2;
+            cpu_time += second;
+
+            THEN("nothing changes") {
+                CHECK_FALSE(governor.update(now, cpu_time));
+                CHECK(governor.fps() == 20);
+            }
+        }
+
+        WHEN("the usage goes down after being over the limit") {
+            now += second;
+            cpu_time += second;
+            REQUIRE(governor.update(now, cpu_time));
+            unsigned lowered = governor.fps();
+            bool raised_early = false;
+            for (unsigned i = 0; i < 2; ++i) {
+                now += second;
+                cpu_time += second / 10;
+                raised_early = raised_early || governor.update(now, cpu_time);
+            }
+            now += second;
+            cpu_time += second / 10;
+            bool raised = governor.update(now, cpu_time);
+
+            THEN("the frame rate is raised after a few measurements") {
+                CHECK(lowered < 20);
+                CHECK_FALSE(raised_early);
+                CHECK(raised);
+                CHECK(governor.fps() > lowered);
+            }
+        }
+
+        WHEN("the usage stays a bit under the limit") {
+            unsigned changes = 0;
+            for (unsigned i = 0; i < 20; ++i) {
+                now += second;
+                cpu_time += second * 2 / 5;
+                changes += governor.update(now, cpu_time);
+            }
+
+            THEN("nothing changes") {
+                CHECK(governor.usage() == 20);
+                CHECK(changes == 0);
+                CHECK(governor.fps() == 20);
+                CHECK(governor.quality() == 80);
+            }
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "event-loop.hpp"
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <thread>
+#include <unistd.h>
+
+namespace ssa = spice::streaming_agent;
+
+
+SCENARIO("test dispatching events", "[event-loop]") {
+    GIVEN("An event loop") {
+        ssa::EventLoop loop;
+
+        WHEN("arming a periodic timer") {
+            unsigned expirations = 0;
+            int timer = 0;
+            timer = loop.add_timer([&]() {
+                if (++expirations == 3) {
+                    loop.remove_timer(timer);
+                    loop.quit();
+                }
+            });
+            loop.set_timer(timer, 1000000, 1000000);
+            loop.run();
+
+            THEN("the handler is called at each expiration") {
+                CHECK(expirations == 3);
+            }
+        }
+
+        WHEN("posting a task from another thread") {
+            std::thread::id loop_thread = std::this_thread::get_id(), task_thread;
+            std::thread poster([&]() {
+                loop.post([&]() {
+                    task_thread = std::this_thread::get_id();
+                    loop.quit();
+                });
+            });
+            loop.run();
+            poster.join();
+
+            THEN("the task runs in the thread of the loop") {
+                CHECK(task_thread == loop_thread);
+            }
+        }
+
+        WHEN("watching a pipe") {
+            int fds[2];
+            REQUIRE(pipe(fds) == 0);
+            char received = 0;
+            loop.add(fds[0], EPOLLIN, [&](uint32_t events) {
+                CHECK((events & EPOLLIN) != 0);
+                REQUIRE(read(fds[0], &received, 1) == 1);
+                loop.remove(fds[0]);
+                loop.quit();
+            });
+            REQUIRE(write(fds[1], "x", 1) == 1);
+            loop.run();
+            close(fds[0]);
+            close(fds[1]);
+
+            THEN("the handler is called when the data is available") {
+                CHECK(received == 'x');
+            }
+        }
+
+        WHEN("handling a signal") {
+            int received = 0;
+            loop.add_signals({SIGUSR1}, [&](int signal) {
+                received = signal;
+                loop.quit();
+            });
+            raise(SIGUSR1);
+            loop.run();
+
+            THEN("the signal is handled by the loop") {
+                CHECK(received == SIGUSR1);
+            }
+        }
+
+        WHEN("a handler throws an exception") {
+            loop.post([]() {
+                throw std::runtime_error("failure");
+            });
+
+            THEN("it is propagated by run") {
+                CHECK_THROWS_AS(loop.run(), std::runtime_error);
+            }
+        }
+    }
+}
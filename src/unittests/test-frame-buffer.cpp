@@ -0,0 +1,88 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "frame-buffer.hpp"
+
+#include <cstring>
+
+namespace ssa = spice::streaming_agent;
+
+
+SCENARIO("test growing frame buffers", "[buffer]") {
+    GIVEN("A buffer with some content") {
+        ssa::FrameBuffer buffer;
+        const uint8_t content[] = "some frame data";
+        buffer.append(content, sizeof(content));
+
+        THEN("the buffer is aligned") {
+            CHECK(buffer.size() == sizeof(content));
+            CHECK(buffer.capacity() >= buffer.size());
+            CHECK(reinterpret_cast<uintptr_t>(buffer.data()) % 64 == 0);
+        }
+
+        WHEN("growing the buffer a lot") {
+            buffer.resize(64 * 1024 * 1024);
+
+            THEN("the content is kept") {
+                CHECK(buffer.size() == 64 * 1024 * 1024);
+                CHECK(memcmp(buffer.data(), content, sizeof(content)) == 0);
+                CHECK(reinterpret_cast<uintptr_t>(buffer.data()) % 64 == 0);
+            }
+        }
+
+        WHEN("moving the buffer") {
+            ssa::FrameBuffer moved(std::move(buffer));
+
+            THEN("the content moves with it") {
+                CHECK(moved.size() == sizeof(content));
+                CHECK(memcmp(moved.data(), content, sizeof(content)) == 0);
+                CHECK(buffer.empty());
+            }
+        }
+    }
+}
+
+SCENARIO("test recycling frame buffers", "[buffer]") {
+    GIVEN("A pool of buffers") {
+        ssa::FrameBufferPool pool;
+
+        WHEN("returning a buffer to the pool") {
+            auto buffer = pool.get();
+            ssa::FrameBuffer *returned = buffer.get();
+            buffer->resize(100000);
+            buffer.reset();
+
+            THEN("the buffer is reused, empty, and the size estimated") {
+                CHECK(pool.estimate() == 100000);
+                buffer = pool.get();
+                CHECK(buffer.get() == returned);
+                CHECK(buffer->empty());
+                CHECK(buffer->capacity() >= 125000);
+            }
+        }
+
+        WHEN("returning buffers of different sizes") {
+            for (size_t size : { 80000, 160000, 160000, 160000 }) {
+                pool.get()->resize(size);
+            }
+
+            THEN("the estimate follows the sizes") {
+                CHECK(pool.estimate() > 80000);
+                CHECK(pool.estimate() < 160000);
+            }
+        }
+
+        WHEN("keeping a buffer after the pool is destroyed") {
+            std::shared_ptr<ssa::FrameBuffer> buffer;
+            {
+                ssa::FrameBufferPool other;
+                buffer = other.get();
+            }
+
+            THEN("the buffer is still usable") {
+                buffer->resize(1000);
+                CHECK(buffer->size() == 1000);
+            }
+        }
+    }
+}
@@ -0,0 +1,133 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "frame-pacer.hpp"
+#include "utils.hpp"
+
+#include <time.h>
+
+namespace ssa = spice::streaming_agent;
+using ssa::utils::get_time;
+
+
+static void sleep_ns(uint64_t ns)
+{
+    timespec delay = { (time_t) (ns / 1000000000u), (long) (ns % 1000000000u) };
+    nanosleep(&delay, nullptr);
+}
+
+SCENARIO("test pacing frames", "[pacer]") {
+    GIVEN("A pacer at 100 fps") {
+        ssa::FramePacer pacer(100);
+        const uint64_t interval = 10000000;
+        REQUIRE(pacer.interval() == interval);
+
+        WHEN("doing frames faster than the rate") {
+            uint64_t start = get_time();
+            for (unsigned i = 0; i < 5; ++i) {
+                pacer.wait();
+            }
+            uint64_t elapsed = get_time() - start;
+
+            THEN("the frames are spaced by the interval") {
+                CHECK(elapsed >= 4 * interval);
+                CHECK(pacer.stats().frames == 5);
+                CHECK(pacer.stats().late == 0);
+                CHECK(pacer.stats().skipped == 0);
+            }
+        }
+
+        WHEN("working for half an interval after each frame") {
+            uint64_t start = get_time();
+            for (unsigned i = 0; i < 5; ++i) {
+                pacer.wait();
+                sleep_ns(interval / 2);
+            }
+            uint64_t elapsed = get_time() - start;
+
+            THEN("the frames keep the rate") {
+                CHECK(elapsed >= 4 * interval + interval / 2);
+                CHECK(elapsed < 5 * interval + interval / 2);
+            }
+        }
+
+        WHEN("missing several deadlines") {
+            pacer.wait();
+            sleep_ns(interval * 3 + interval / 2);
+            uint64_t before = get_time();
+            pacer.wait();
+            uint64_t late_wait = get_time() - before;
+            pacer.wait();
+            uint64_t next_wait = get_time() - before;
+
+            THEN("the late ticks are skipped instead of bursting") {
+                CHECK(late_wait < interval / 4);
+                CHECK(pacer.stats().late == 1);
+                CHECK(pacer.stats().skipped == 2);
+                CHECK(pacer.stats().max_jitter >= interval / 2);
+                // the next frame is on the grid, not right after the late one
+                CHECK(next_wait >= interval / 4);
+            }
+        }
+
+        WHEN("restarting after waiting for a change") {
+            pacer.wait();
+            sleep_ns(interval * 3);
+            pacer.restart();
+            uint64_t before = get_time();
+            pacer.wait();
+
+            THEN("the wait is not counted as late") {
+                CHECK(get_time() - before >= interval / 2);
+                CHECK(pacer.stats().late == 0);
+                CHECK(pacer.stats().skipped == 0);
+            }
+        }
+
+        WHEN("restarting right after an on time frame") {
+            pacer.wait();
+            uint64_t deadline = pacer.next_deadline();
+            pacer.restart();
+
+            THEN("the grid is kept") {
+                CHECK(pacer.next_deadline() == deadline);
+            }
+        }
+
+        WHEN("raising the rate between two frames") {
+            pacer.wait();
+            uint64_t tick = pacer.next_deadline() - interval;
+            pacer.set_rate(1000);
+
+            THEN("the next deadline is one new interval after the last tick") {
+                CHECK(pacer.next_deadline() == tick + interval / 10);
+            }
+        }
+
+        WHEN("raising the rate after the new interval already passed") {
+            pacer.wait();
+            sleep_ns(interval / 2);
+            uint64_t before = get_time();
+            pacer.set_rate(1000);
+            uint64_t next = pacer.next_deadline();
+            pacer.wait();
+            uint64_t waited = get_time() - before;
+
+            THEN("the next frame is due now without skipping ticks") {
+                CHECK(next >= before);
+                CHECK(waited < interval / 4);
+                CHECK(pacer.stats().skipped == 0);
+            }
+        }
+
+        WHEN("lowering the rate between two frames") {
+            pacer.wait();
+            uint64_t tick = pacer.next_deadline() - interval;
+            pacer.set_rate(10);
+
+            THEN("the next deadline is postponed") {
+                CHECK(pacer.next_deadline() == tick + interval * 10);
+            }
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "frame-queue.hpp"
+
+#include <cstring>
+#include <thread>
+
+namespace ssa = spice::streaming_agent;
+
+
+SCENARIO("test queueing frames between two threads", "[queue]") {
+    GIVEN("A queue of two frames") {
+        ssa::FrameQueue queue(2);
+        ssa::FrameBufferPool pool;
+
+        WHEN("producing more frames than the queue can hold") {
+            const unsigned count = 1000;
+            std::thread producer([&]() {
+                for (unsigned i = 0; i < count; ++i) {
+                    ssa::QueuedFrame frame;
+                    frame.width = i;
+                    frame.buffer = pool.get();
+                    frame.buffer->append(reinterpret_cast<const uint8_t *>(&i), sizeof(i));
+                    REQUIRE(queue.push(std::move(frame)));
+                }
+            });
+
+            bool in_order = true;
+            ssa::QueuedFrame frame;
+            for (unsigned i = 0; i < count; ++i) {
+                REQUIRE(queue.pop(frame));
+                unsigned value;
+                memcpy(&value, frame.buffer->data(), sizeof(value));
+                in_order = in_order && frame.width == i && value == i;
+            }
+            producer.join();
+
+            THEN("the consumer gets all of them in order") {
+                CHECK(in_order);
+            }
+        }
+
+        WHEN("queueing droppable frames") {
+            for (unsigned i = 0; i < 5; ++i) {
+                ssa::QueuedFrame frame;
+                frame.width = i;
+                frame.droppable = true;
+                REQUIRE(queue.push(std::move(frame)));
+            }
+            ssa::QueuedFrame frame;
+            REQUIRE(queue.pop(frame));
+
+            THEN("only the latest one is popped, without waiting") {
+                CHECK(frame.width == 4);
+                CHECK(queue.dropped() == 4);
+            }
+        }
+
+        WHEN("a slow consumer takes droppable frames") {
+            const unsigned count = 10000;
+            std::thread producer([&]() {
+                for (unsigned i = 0; i < count; ++i) {
+                    ssa::QueuedFrame frame;
+                    frame.width = i;
+                    frame.droppable = i + 1 < count;
+                    REQUIRE(queue.push(std::move(frame)));
+                }
+            });
+
+            bool in_order = true;
+            unsigned popped = 0, last = 0;
+            ssa::QueuedFrame frame;
+            do {
+                REQUIRE(queue.pop(frame));
+                in_order = in_order && (popped == 0 || frame.width > last);
+                last = frame.width;
+                ++popped;
+                std::this_thread::yield();
+            } while (last != count - 1);
+            producer.join();
+
+            THEN("the frames are still in order and all counted") {
+                CHECK(in_order);
+                CHECK(popped + queue.dropped() == count);
+            }
+        }
+
+        WHEN("queueing a frame which cannot be dropped before droppable ones") {
+            ssa::QueuedFrame start;
+            start.stream_start = true;
+            REQUIRE(queue.push(std::move(start)));
+            for (unsigned i = 1; i < 4; ++i) {
+                ssa::QueuedFrame frame;
+                frame.width = i;
+                frame.droppable = true;
+                REQUIRE(queue.push(std::move(frame)));
+            }
+            ssa::QueuedFrame first, second;
+            REQUIRE(queue.pop(first));
+            REQUIRE(queue.pop(second));
+
+            THEN("it is kept") {
+                CHECK(first.stream_start);
+                CHECK(second.width == 3);
+                CHECK(queue.dropped() == 2);
+            }
+        }
+
+        WHEN("closing the queue while the consumer waits") {
+            bool popped = true;
+            std::thread consumer([&]() {
+                ssa::QueuedFrame frame;
+                popped = queue.pop(frame);
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            queue.close();
+            consumer.join();
+
+            THEN("the consumer is woken up and further pushes fail") {
+                CHECK_FALSE(popped);
+                CHECK_FALSE(queue.push(ssa::QueuedFrame()));
+            }
+        }
+
+        WHEN("closing the queue while the producer waits") {
+            REQUIRE(queue.push(ssa::QueuedFrame()));
+            REQUIRE(queue.push(ssa::QueuedFrame()));
+            bool pushed = true;
+            std::thread producer([&]() {
+                pushed = queue.push(ssa::QueuedFrame());
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            queue.close();
+            producer.join();
+
+            THEN("the producer is woken up") {
+                CHECK_FALSE(pushed);
+            }
+        }
+    }
+}
@@ -14,6 +14,18 @@ SCENARIO("test parsing mjpeg plugin options", "[mjpeg][options]") {
             std::vector<ssa::ConfigureOption> options = {
                 {"framerate", "20"},
                 {"mjpeg.quality", "90"},
+                {"mjpeg.keepalive", "500"},
+                {"damage", "off"},
+                {"mjpeg.threads", "4"},
+                {"mjpeg.pipeline-depth", "3"},
+                {"mjpeg.target-bitrate", "2000"},
+                {"mjpeg.max-latency", "50"},
+                {"mjpeg.min-quality", "30"},
+                {"mjpeg.adaptive-fps", "on"},
+                {"cpu-limit", "40"},
+                {"mjpeg.idle-framerate", "2"},
+                {"mjpeg.input-quiet-period", "3000"},
+                {"min-framerate", "1"},
                 {NULL, NULL}
             };
 
@@ -23,6 +35,18 @@ SCENARIO("test parsing mjpeg plugin options", "[mjpeg][options]") {
             THEN("the options are set in the plugin") {
                 CHECK(new_options.fps == 20);
                 CHECK(new_options.quality == 90);
+                CHECK(new_options.keepalive == 500);
+                CHECK(new_options.damage == false);
+                CHECK(new_options.threads == 4);
+                CHECK(new_options.pipeline_depth == 3);
+                CHECK(new_options.target_bitrate == 2000);
+                CHECK(new_options.max_latency == 50);
+                CHECK(new_options.min_quality == 30);
+                CHECK(new_options.adaptive_fps == true);
+                CHECK(new_options.cpu_limit == 40);
+                CHECK(new_options.idle_fps == 2);
+                CHECK(new_options.input_quiet_period == 3000);
+                CHECK(new_options.min_fps == 1);
             }
         }
 
@@ -0,0 +1,73 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "parallel-jpeg.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace ssa = spice::streaming_agent;
+
+static bool same_data(const ssa::FrameBuffer &a, const ssa::FrameBuffer &b)
+{
+    return a.size() == b.size() && std::equal(a.data(), a.data() + a.size(), b.data());
+}
+
+
+SCENARIO("test encoding images in stripes", "[jpeg]") {
+    GIVEN("An image split in several stripes") {
+        const unsigned width = 1283, height = 300;
+        const size_t stride = width * 4 + 12;
+        std::vector<uint8_t> image(stride * height);
+        for (auto &byte : image) {
+            byte = rand();
+        }
+        ssa::ParallelJpegEncoder encoder(3), reference(1);
+        ssa::TileDiff tiles;
+        ssa::FrameBuffer jpeg, expected;
+
+        tiles.mark_all(width, height);
+        encoder.encode(jpeg, 80, image.data(), width, height, stride, &tiles);
+
+        THEN("the image is a JPEG with restart markers") {
+            REQUIRE(jpeg.size() > 4);
+            CHECK(jpeg.data()[0] == 0xff);
+            CHECK(jpeg.data()[1] == 0xd8);
+            CHECK(jpeg.data()[jpeg.size() - 2] == 0xff);
+            CHECK(jpeg.data()[jpeg.size() - 1] == 0xd9);
+            CHECK(encoder.encoded_stripes() == 5);
+        }
+
+        WHEN("encoding the image with a different number of threads") {
+            reference.encode(expected, 80, image.data(), width, height, stride);
+
+            THEN("the result is the same") {
+                CHECK(same_data(jpeg, expected));
+            }
+        }
+
+        WHEN("encoding a modified image with the changed tiles") {
+            std::vector<uint8_t> modified = image;
+            modified[stride * 100 + 500 * 4] ^= 0x80;
+            tiles.compare(image.data(), modified.data(), width, height, stride);
+            encoder.encode(jpeg, 80, modified.data(), width, height, stride, &tiles);
+            reference.encode(expected, 80, modified.data(), width, height, stride);
+
+            THEN("only the changed stripe is encoded again") {
+                CHECK(encoder.encoded_stripes() == 1);
+                CHECK(same_data(jpeg, expected));
+            }
+        }
+
+        WHEN("changing the quality") {
+            tiles.compare(image.data(), image.data(), width, height, stride);
+            encoder.encode(jpeg, 50, image.data(), width, height, stride, &tiles);
+            reference.encode(expected, 50, image.data(), width, height, stride);
+
+            THEN("all the stripes are encoded again") {
+                CHECK(encoder.encoded_stripes() == 5);
+                CHECK(same_data(jpeg, expected));
+            }
+        }
+    }
+}
@@ -0,0 +1,127 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "quality-controller.hpp"
+
+namespace ssa = spice::streaming_agent;
+
+
+SCENARIO("test adapting the quality", "[quality]") {
+    GIVEN("A controller with a target bitrate of 8 Mbit/s at 10 fps") {
+        ssa::QualityController::Settings settings;
+        settings.max_quality = 80;
+        settings.min_quality = 50;
+        settings.max_fps = 10;
+        settings.adapt_fps = true;
+        settings.target_bitrate = 8000000;
+        ssa::QualityController controller(settings);
+        const uint64_t interval = 100000000;
+        uint64_t now = interval;
+
+        WHEN("the frames are twice too large") {
+            unsigned changes = 0;
+            for (unsigned i = 0; i < 200; ++i, now += interval) {
+                changes += controller.update(now, 200000, nullptr);
+            }
+
+            THEN("the quality goes down to the minimum, then the frame rate") {
+                CHECK(changes > 6);
+                CHECK(controller.quality() == 50);
+                CHECK(controller.fps() < 10);
+            }
+        }
+
+        WHEN("the frames are a bit below the target") {
+            unsigned changes = 0;
+            for (unsigned i = 0; i < 100; ++i, now += interval) {
+                changes += controller.update(now, 87500, nullptr);
+            }
+
+            THEN("the quality is neither lowered nor raised") {
+                CHECK(changes == 0);
+                CHECK(controller.quality() == 80);
+            }
+        }
+
+        WHEN("the frames are too large, then small") {
+            for (unsigned i = 0; i < 20; ++i, now += interval) {
+                controller.update(now, 150000, nullptr);
+            }
+            // the smoothed bitrate takes a few frames to go down
+            int lowered = controller.quality();
+            unsigned frames = 0;
+            while (controller.quality() <= lowered && frames < 100) {
+                controller.update(now, 10000, nullptr);
+                now += interval;
+                ++frames;
+                if (controller.quality() < lowered) {
+                    lowered = controller.quality();
+                    frames = 0;
+                }
+            }
+
+            THEN("the quality is raised only after a while") {
+                CHECK(lowered < 80);
+                CHECK(controller.quality() > lowered);
+                CHECK(frames >= 30);
+            }
+        }
+
+        WHEN("the frames stay well below the target") {
+            unsigned changes = 0;
+            for (unsigned i = 0; i < 100; ++i, now += interval) {
+                changes += controller.update(now, 10000, nullptr);
+            }
+
+            THEN("nothing changes") {
+                CHECK(changes == 0);
+                CHECK(controller.quality() == 80);
+                CHECK(controller.fps() == 10);
+            }
+        }
+    }
+
+    GIVEN("A controller with a latency ceiling of 20 ms") {
+        ssa::QualityController::Settings settings;
+        settings.max_quality = 80;
+        settings.min_quality = 20;
+        settings.max_latency = 20000000;
+        ssa::QualityController controller(settings);
+        const uint64_t interval = 100000000;
+        uint64_t now = interval;
+        ssa::TransportStats stats{};
+
+        WHEN("the port writes 1 MB/s") {
+            for (unsigned i = 0; i < 10; ++i, now += interval) {
+                // frames of 50 kB written in 50 ms
+                stats.bytes_sent += 50000;
+                stats.write_time += 50000000;
+                controller.update(now, 50000, &stats);
+            }
+
+            THEN("the quality is lowered") {
+                CHECK(controller.latency() > 20000000);
+                CHECK(controller.quality() < 80);
+            }
+        }
+
+        WHEN("the port goes fast again") {
+            for (unsigned i = 0; i < 40; ++i, now += interval) {
+                stats.bytes_sent += 50000;
+                stats.write_time += 50000000;
+                controller.update(now, 50000, &stats);
+            }
+            int lowered = controller.quality();
+            for (unsigned i = 0; i < 200; ++i, now += interval) {
+                stats.bytes_sent += 20000;
+                stats.write_time += 1000000;
+                controller.update(now, 20000, &stats);
+            }
+
+            THEN("the quality is restored") {
+                CHECK(lowered < 80);
+                CHECK(controller.quality() == 80);
+            }
+        }
+    }
+}
@@ -7,7 +7,11 @@
 #define CATCH_CONFIG_MAIN
 #include "spice-catch.hpp"
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <thread>
 
 #include "stream-port.hpp"
 #include <spice-streaming-agent/error.hpp>
@@ -56,6 +60,37 @@ SCENARIO("test basic IO on the stream port", "[port][io]") {
             CHECK(std::string(buf, src_size) == src_buf);
         }
 
+        WHEN("writing several buffers at once") {
+            iovec iov[] = {
+                { const_cast<char *>(src_buf), 3 },
+                { const_cast<char *>(src_buf + 3), 0 },
+                { const_cast<char *>(src_buf + 3), 4 },
+            };
+            ssa::writev_all(fd[1], iov, 3);
+            char buf[10];
+            CHECK(read(fd[0], buf, src_size) == src_size);
+            CHECK(std::string(buf, src_size) == src_buf);
+        }
+
+        WHEN("writing several buffers larger than the socket buffer") {
+            std::vector<uint8_t> data(4 * 1024 * 1024);
+            for (size_t i = 0; i < data.size(); ++i) {
+                data[i] = i * 7 + i / 251;
+            }
+            std::vector<uint8_t> received(data.size());
+            std::thread reader([&] {
+                ssa::read_all(fd[0], received.data(), received.size());
+            });
+            iovec iov[] = {
+                { data.data(), 10 },
+                { data.data() + 10, data.size() / 2 - 10 },
+                { data.data() + data.size() / 2, data.size() / 2 },
+            };
+            ssa::writev_all(fd[1], iov, 3);
+            reader.join();
+            CHECK(received == data);
+        }
+
         WHEN("closing the remote end and trying to read") {
             CHECK(write(fd[0], src_buf, src_size) == src_size);
             char buf[10];
@@ -84,3 +119,139 @@ SCENARIO("test basic IO on the stream port", "[port][io]") {
         close(fd[1]);
     }
 }
+
+namespace {
+
+class TestMessage : public ssa::OutboundMessage<StreamMsgData, TestMessage, STREAM_TYPE_DATA>
+{
+public:
+    TestMessage(const std::vector<uint8_t> &data) : OutboundMessage(data) {}
+
+    static size_t size(const std::vector<uint8_t> &data)
+    {
+        return data.size();
+    }
+
+    void collect_body(ssa::IoVector &iov, const std::vector<uint8_t> &data)
+    {
+        iov.add(data.data(), data.size());
+    }
+};
+
+std::vector<uint8_t> read_message(int fd)
+{
+    StreamDevHeader header;
+    ssa::read_all(fd, &header, sizeof(header));
+    std::vector<uint8_t> data(header.size);
+    ssa::read_all(fd, data.data(), data.size());
+    return data;
+}
+
+}
+
+SCENARIO("test sending messages on the stream port", "[port][io]") {
+    GIVEN("A port (FIFO) with a reader") {
+        char dir_template[] = "/tmp/test-stream-port-XXXXXX";
+        REQUIRE(mkdtemp(dir_template));
+        const std::string path = std::string(dir_template) + "/port";
+        REQUIRE(mkfifo(path.c_str(), 0600) == 0);
+
+        ssa::StreamPort port(path);
+        int reader = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+        REQUIRE(reader >= 0);
+
+        // larger than the buffer of the FIFO
+        std::vector<uint8_t> frame(256 * 1024 + 123);
+        for (size_t i = 0; i < frame.size(); ++i) {
+            frame[i] = i * 13 + i / 509;
+        }
+        const std::vector<uint8_t> cursor(100, 42);
+
+        WHEN("posting a message while a large one is being sent") {
+            std::thread sender([&] {
+                port.send<TestMessage>(frame);
+            });
+
+            // the sender is blocked in the middle of the frame as the
+            // FIFO buffer is smaller than the frame
+            StreamDevHeader header;
+            ssa::read_all(reader, &header, sizeof(header));
+            port.post<TestMessage>(cursor);
+
+            std::vector<uint8_t> received_frame(header.size);
+            ssa::read_all(reader, received_frame.data(), received_frame.size());
+            std::vector<uint8_t> received_cursor = read_message(reader);
+            sender.join();
+
+            THEN("the messages are not interleaved") {
+                CHECK(received_frame == frame);
+                CHECK(received_cursor == cursor);
+            }
+        }
+
+        WHEN("interrupting a message being sent") {
+            bool interrupted = false;
+            std::thread sender([&] {
+                try {
+                    port.send<TestMessage>(frame);
+                } catch (const ssa::WriteError &) {
+                    interrupted = true;
+                }
+            });
+
+            // wait for the sender to fill the FIFO buffer
+            StreamDevHeader header;
+            ssa::read_all(reader, &header, sizeof(header));
+            port.interrupt();
+            sender.join();
+
+            THEN("the write fails, as do the next ones which do not fit") {
+                CHECK(interrupted);
+                CHECK_THROWS_AS(port.send<TestMessage>(frame), ssa::WriteError);
+            }
+        }
+
+        WHEN("posting a message while no message is being sent") {
+            port.post<TestMessage>(cursor);
+            port.send<TestMessage>(cursor);
+
+            THEN("it is sent immediately") {
+                CHECK(read_message(reader) == cursor);
+                CHECK(read_message(reader) == cursor);
+            }
+        }
+
+        WHEN("receiving a message arriving in several parts") {
+            int writer = open(path.c_str(), O_WRONLY | O_NONBLOCK);
+            REQUIRE(writer >= 0);
+            StreamDevHeader header{};
+            header.protocol_version = STREAM_DEVICE_PROTOCOL;
+            header.type = STREAM_TYPE_START_STOP;
+            header.size = 2;
+            const uint8_t codecs[] = { 1, SPICE_VIDEO_CODEC_TYPE_MJPEG };
+
+            ssa::write_all(writer, &header, 3);
+            std::unique_ptr<ssa::InboundMessage> no_header = port.receive();
+            ssa::write_all(writer, (const uint8_t *) &header + 3, sizeof(header) - 3);
+            ssa::write_all(writer, codecs, 1);
+            std::unique_ptr<ssa::InboundMessage> no_data = port.receive();
+            ssa::write_all(writer, codecs + 1, 1);
+            std::unique_ptr<ssa::InboundMessage> message = port.receive();
+            close(writer);
+
+            THEN("it is returned once complete, without blocking") {
+                CHECK(!no_header.get());
+                CHECK(!no_data.get());
+                REQUIRE(bool(message));
+                CHECK(message->header.type == STREAM_TYPE_START_STOP);
+                ssa::StartStopMessage msg = message->get_payload<ssa::StartStopMessage>();
+                CHECK(msg.start_streaming);
+                CHECK(msg.client_codecs.count(SPICE_VIDEO_CODEC_TYPE_MJPEG) == 1);
+            }
+        }
+
+        close(reader);
+        unlink(path.c_str());
+        rmdir(dir_template);
+    }
+}
@@ -0,0 +1,85 @@
+#define CATCH_CONFIG_MAIN
+#include "spice-catch.hpp"
+
+#include "tile-diff.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+namespace ssa = spice::streaming_agent;
+
+
+SCENARIO("test detecting changed tiles", "[tiles]") {
+    GIVEN("Two identical frames with a padded stride") {
+        const unsigned width = 1283, height = 37;
+        const size_t stride = width * 4 + 12;
+        std::vector<uint8_t> prev(stride * height);
+        for (auto &byte : prev) {
+            byte = rand();
+        }
+        std::vector<uint8_t> cur = prev;
+        ssa::TileDiff diff;
+
+        WHEN("comparing the frames") {
+            unsigned changed = diff.compare(prev.data(), cur.data(), width, height, stride);
+
+            THEN("no tile changed") {
+                CHECK(changed == 0);
+                CHECK(diff.columns() == 21);
+                CHECK(diff.rows() == 3);
+            }
+        }
+
+        WHEN("changing pixels in the partial tiles at the borders") {
+            cur[stride * 20 + 1282 * 4 + 3] ^= 1;
+            cur[stride * 36] ^= 1;
+            unsigned changed = diff.compare(prev.data(), cur.data(), width, height, stride);
+
+            THEN("only these tiles are marked") {
+                CHECK(changed == 2);
+                CHECK(diff.tile_changed(20, 1));
+                CHECK(diff.tile_changed(0, 2));
+                CHECK_FALSE(diff.row_changed(0));
+                CHECK(diff.row_changed(1));
+            }
+        }
+
+        WHEN("changing the padding after the last pixel of a line") {
+            cur[stride * 5 + width * 4 + 4] ^= 1;
+            unsigned changed = diff.compare(prev.data(), cur.data(), width, height, stride);
+
+            THEN("the change is ignored") {
+                CHECK(changed == 0);
+            }
+        }
+
+        WHEN("marking the whole frame") {
+            diff.mark_all(width, height);
+
+            THEN("all the tiles are changed") {
+                CHECK(diff.row_changed(0));
+                CHECK(diff.row_changed(2));
+                CHECK(diff.tile_changed(20, 2));
+            }
+        }
+
+        WHEN("copying rectangles into the previous frame") {
+            diff.clear(width, height);
+            std::vector<uint8_t> rect(100 * 4 * 20);
+            for (unsigned line = 0; line < 20; ++line) {
+                memcpy(&rect[line * 400], &prev[(10 + line) * stride + 60 * 4], 400);
+            }
+            unsigned same = diff.copy_rect(prev.data(), stride, rect.data(), 400, 60, 10, 100, 20);
+            rect[19 * 400 + 399] ^= 1;
+            unsigned changed = diff.copy_rect(prev.data(), stride, rect.data(), 400, 60, 10, 100, 20);
+
+            THEN("only the tiles with different pixels are marked") {
+                CHECK(same == 0);
+                CHECK(changed == 1);
+                CHECK(diff.count() == 1);
+                CHECK(diff.tile_changed(2, 1));
+                CHECK(prev[29 * stride + 159 * 4 + 3] == rect[19 * 400 + 399]);
+            }
+        }
+    }
+}
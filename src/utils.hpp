@@ -4,9 +4,11 @@
 
 #pragma once
 
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <syslog.h>
+#include <time.h>
 
 
 namespace spice {
@@ -15,6 +17,22 @@ namespace utils {
 
 std::vector<std::string> glob(const std::string& pattern);
 
+/*! Time of a clock in nanoseconds */
+inline uint64_t get_time(clockid_t clock)
+{
+    timespec now;
+
+    clock_gettime(clock, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/*! Time on CLOCK_MONOTONIC in nanoseconds */
+inline uint64_t get_time()
+{
+    return get_time(CLOCK_MONOTONIC);
+}
+
 template<class T>
 const T &syslog(const T &error) noexcept
 {
@@ -0,0 +1,102 @@
+/* Pool of threads running batches of tasks.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "worker-pool.hpp"
+
+
+namespace spice {
+namespace streaming_agent {
+
+WorkerPool::WorkerPool(unsigned size)
+{
+    for (unsigned worker = 1; worker < size; ++worker) {
+        threads.emplace_back(&WorkerPool::worker_main, this, worker);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    start_cond.notify_all();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::run(unsigned count, const Task &task)
+{
+    if (count == 0) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    this->task = &task;
+    this->count = count;
+    next = 0;
+    pending = count;
+    error = nullptr;
+    ++generation;
+    lock.unlock();
+    start_cond.notify_all();
+
+    process_tasks(0);
+
+    lock.lock();
+    done_cond.wait(lock, [this] { return pending == 0; });
+    this->task = nullptr;
+    if (error) {
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+void WorkerPool::worker_main(unsigned worker)
+{
+    unsigned long seen = 0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cond.wait(lock, [this, seen] { return quit || generation != seen; });
+            if (quit) {
+                return;
+            }
+            seen = generation;
+        }
+        process_tasks(worker);
+    }
+}
+
+void WorkerPool::process_tasks(unsigned worker)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (task && next < count) {
+        const Task &current = *task;
+        unsigned index = next++;
+        lock.unlock();
+
+        std::exception_ptr e;
+        try {
+            current(index, worker);
+        } catch (...) {
+            e = std::current_exception();
+        }
+
+        lock.lock();
+        if (e && !error) {
+            error = e;
+        }
+        if (--pending == 0) {
+            done_cond.notify_one();
+        }
+    }
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,67 @@
+/* Pool of threads running batches of tasks.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Persistent threads executing batches of independent tasks.
+ *
+ * The thread calling run() takes part in the execution, so a pool of
+ * size 1 runs the tasks on the calling thread only.
+ */
+class WorkerPool
+{
+public:
+    /*!
+     * Tasks receive the index of the task and the index of the worker
+     * running it, in [0, size()). A worker runs one task at a time so the
+     * worker index can be used to access per-worker data without locking.
+     */
+    typedef std::function<void(unsigned task, unsigned worker)> Task;
+
+    explicit WorkerPool(unsigned size);
+    ~WorkerPool();
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    unsigned size() const
+    {
+        return threads.size() + 1;
+    }
+
+    /*!
+     * Run task for the indices [0, count) and wait for all of them to
+     * complete. If tasks throw, the first exception is rethrown.
+     */
+    void run(unsigned count, const Task &task);
+
+private:
+    void worker_main(unsigned worker);
+    void process_tasks(unsigned worker);
+
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable start_cond, done_cond;
+    // the current batch, protected by mutex
+    const Task *task = nullptr;
+    unsigned count = 0, next = 0, pending = 0;
+    unsigned long generation = 0;
+    std::exception_ptr error;
+    bool quit = false;
+};
+
+}} // namespace spice::streaming_agent
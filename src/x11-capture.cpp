@@ -0,0 +1,332 @@
+/* Screen grabbing from X11 using MIT-SHM when available.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "x11-capture.hpp"
+#include "tile-diff.hpp"
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <mutex>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <syslog.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+namespace {
+
+// the traps alive, the last ones created first
+std::mutex traps_mutex;
+std::vector<XErrorTrap *> traps;
+XErrorHandler previous_handler = nullptr;
+std::once_flag handler_installed;
+
+}
+
+XErrorTrap::XErrorTrap(Display *dpy):
+    dpy(dpy),
+    first_serial(NextRequest(dpy))
+{
+    std::call_once(handler_installed, [] {
+        previous_handler = XSetErrorHandler(handle_error);
+    });
+    std::lock_guard<std::mutex> lock(traps_mutex);
+    traps.insert(traps.begin(), this);
+}
+
+XErrorTrap::~XErrorTrap()
+{
+    std::lock_guard<std::mutex> lock(traps_mutex);
+    traps.erase(std::find(traps.begin(), traps.end(), this));
+}
+
+bool XErrorTrap::failed()
+{
+    XSync(dpy, False);
+    std::lock_guard<std::mutex> lock(traps_mutex);
+    return error;
+}
+
+int XErrorTrap::handle_error(Display *dpy, XErrorEvent *event)
+{
+    {
+        std::lock_guard<std::mutex> lock(traps_mutex);
+        // the innermost trap covering the request
+        for (auto trap : traps) {
+            if (trap->dpy == dpy && event->serial >= trap->first_serial) {
+                trap->error = true;
+                return 0;
+            }
+        }
+    }
+    return previous_handler ? previous_handler(dpy, event) : 0;
+}
+
+X11Capture::X11Capture(Display *dpy) :
+    dpy(dpy),
+    use_shm(XShmQueryExtension(dpy))
+{
+    for (auto &buffer : buffers) {
+        buffer.shminfo.shmid = -1;
+        buffer.shminfo.shmaddr = reinterpret_cast<char*>(-1);
+    }
+    scratch.shminfo.shmid = -1;
+    scratch.shminfo.shmaddr = reinterpret_cast<char*>(-1);
+    if (!use_shm) {
+        syslog(LOG_NOTICE, "MIT-SHM extension not available, using XGetImage for capture");
+    }
+}
+
+X11Capture::~X11Capture()
+{
+    for (auto &buffer : buffers) {
+        free_buffer(buffer);
+    }
+    free_buffer(scratch);
+    if (shadow) {
+        shadow->data = nullptr;
+        XDestroyImage(shadow);
+    }
+}
+
+XImage *create_shm_image(Display *dpy, XShmSegmentInfo &shminfo, unsigned width, unsigned height)
+{
+    int screen = XDefaultScreen(dpy);
+
+    shminfo.shmid = -1;
+    shminfo.shmaddr = reinterpret_cast<char*>(-1);
+    XImage *image = XShmCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen),
+                                    ZPixmap, nullptr, &shminfo, width, height);
+    if (!image) {
+        return nullptr;
+    }
+
+    shminfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+    if (shminfo.shmid < 0) {
+        syslog(LOG_WARNING, "shmget failed for a %ux%u capture buffer: %m", width, height);
+        XDestroyImage(image);
+        return nullptr;
+    }
+
+    shminfo.shmaddr = image->data = static_cast<char*>(shmat(shminfo.shmid, nullptr, 0));
+    if (shminfo.shmaddr == reinterpret_cast<char*>(-1)) {
+        syslog(LOG_WARNING, "shmat failed for a %ux%u capture buffer: %m", width, height);
+        shmctl(shminfo.shmid, IPC_RMID, nullptr);
+        shminfo.shmid = -1;
+        image->data = nullptr;
+        XDestroyImage(image);
+        return nullptr;
+    }
+    shminfo.readOnly = False;
+
+    // XShmAttach reports failures (e.g. for a remote X server)
+    // asynchronously through the error handler
+    XErrorTrap trap(dpy);
+    Status attached = XShmAttach(dpy, &shminfo);
+    const bool failed = trap.failed();
+
+    // the segment is destroyed once both the server and us detach from it
+    shmctl(shminfo.shmid, IPC_RMID, nullptr);
+
+    if (!attached || failed) {
+        syslog(LOG_WARNING, "XShmAttach failed");
+        shmdt(shminfo.shmaddr);
+        shminfo.shmaddr = reinterpret_cast<char*>(-1);
+        shminfo.shmid = -1;
+        image->data = nullptr;
+        XDestroyImage(image);
+        return nullptr;
+    }
+    return image;
+}
+
+bool X11Capture::alloc_shm_buffer(Buffer &buffer, unsigned width, unsigned height)
+{
+    buffer.image = create_shm_image(dpy, buffer.shminfo, width, height);
+    return buffer.image != nullptr;
+}
+
+void X11Capture::free_buffer(Buffer &buffer)
+{
+    XShmSegmentInfo &shminfo = buffer.shminfo;
+
+    if (shminfo.shmaddr && shminfo.shmaddr != reinterpret_cast<char*>(-1)) {
+        XShmDetach(dpy, &shminfo);
+        XSync(dpy, False);
+        shmdt(shminfo.shmaddr);
+        if (buffer.image) {
+            buffer.image->data = nullptr;
+        }
+    } else if (shminfo.shmid >= 0) {
+        shmctl(shminfo.shmid, IPC_RMID, nullptr);
+    }
+    shminfo.shmid = -1;
+    shminfo.shmaddr = reinterpret_cast<char*>(-1);
+
+    if (buffer.image) {
+        XDestroyImage(buffer.image);
+        buffer.image = nullptr;
+    }
+}
+
+void X11Capture::disable_shm()
+{
+    // the other buffer holds the previous frame, it is released by the next grab()
+    syslog(LOG_WARNING, "Cannot use MIT-SHM for capture, falling back to XGetImage");
+    use_shm = false;
+}
+
+XImage *X11Capture::grab(Window win, unsigned width, unsigned height)
+{
+    // a failed read would otherwise exit the process
+    XErrorTrap trap(dpy);
+    current ^= 1;
+    Buffer &buffer = buffers[current];
+
+    if (use_shm) {
+        if (buffer.image && (buffer.image->width != (int) width ||
+                             buffer.image->height != (int) height)) {
+            free_buffer(buffer);
+        }
+        if (!buffer.image && !alloc_shm_buffer(buffer, width, height)) {
+            disable_shm();
+        } else if (XShmGetImage(dpy, win, buffer.image, 0, 0, AllPlanes)) {
+            return buffer.image;
+        } else {
+            disable_shm();
+        }
+    }
+
+    free_buffer(buffer);
+    buffer.image = XGetImage(dpy, win, 0, 0, width, height, AllPlanes, ZPixmap);
+    if (!buffer.image) {
+        throw Error("Cannot capture from X");
+    }
+    return buffer.image;
+}
+
+void X11Capture::alloc_shadow(unsigned width, unsigned height)
+{
+    int screen = XDefaultScreen(dpy);
+
+    if (shadow) {
+        // the data belong to shadow_data
+        shadow->data = nullptr;
+        XDestroyImage(shadow);
+    }
+    shadow = XCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen),
+                          ZPixmap, 0, nullptr, width, height, 32, 0);
+    if (!shadow) {
+        throw Error("Cannot create the shadow image");
+    }
+    // new pages are provided already zeroed by the system so the first
+    // comparisons do not read uninitialized memory
+    try {
+        shadow_data.resize(size_t(shadow->bytes_per_line) * height);
+    } catch (const Error &) {
+        XDestroyImage(shadow);
+        shadow = nullptr;
+        throw;
+    }
+    shadow->data = reinterpret_cast<char*>(shadow_data.data());
+}
+
+void X11Capture::fetch_rect(Window win, const XRectangle &rect, TileDiff &tiles)
+{
+    XErrorTrap trap(dpy);
+    XImage *image = nullptr;
+
+    if (use_shm) {
+        int screen = XDefaultScreen(dpy);
+        if (!scratch.image && !alloc_shm_buffer(scratch, shadow->width, shadow->height)) {
+            free_buffer(scratch);
+            disable_shm();
+        } else {
+            // an image header of the size of the rectangle using the scratch segment
+            image = XShmCreateImage(dpy, DefaultVisual(dpy, screen), DefaultDepth(dpy, screen),
+                                    ZPixmap, scratch.shminfo.shmaddr, &scratch.shminfo,
+                                    rect.width, rect.height);
+            if (image && XShmGetImage(dpy, win, image, rect.x, rect.y, AllPlanes)) {
+                tiles.copy_rect(reinterpret_cast<uint8_t*>(shadow->data), shadow->bytes_per_line,
+                                reinterpret_cast<uint8_t*>(image->data), image->bytes_per_line,
+                                rect.x, rect.y, rect.width, rect.height);
+                image->data = nullptr;
+                XDestroyImage(image);
+                return;
+            }
+            if (image) {
+                image->data = nullptr;
+                XDestroyImage(image);
+            }
+            free_buffer(scratch);
+            disable_shm();
+        }
+    }
+
+    image = XGetImage(dpy, win, rect.x, rect.y, rect.width, rect.height, AllPlanes, ZPixmap);
+    if (!image) {
+        throw Error("Cannot capture from X");
+    }
+    tiles.copy_rect(reinterpret_cast<uint8_t*>(shadow->data), shadow->bytes_per_line,
+                    reinterpret_cast<uint8_t*>(image->data), image->bytes_per_line,
+                    rect.x, rect.y, rect.width, rect.height);
+    XDestroyImage(image);
+}
+
+XImage *X11Capture::update(Window win, unsigned width, unsigned height,
+                           const std::vector<XRectangle> &rects, TileDiff &tiles)
+{
+    XRectangle full = { 0, 0, (unsigned short) width, (unsigned short) height };
+
+    if (!shadow || shadow->width != (int) width || shadow->height != (int) height) {
+        free_buffer(scratch);
+        alloc_shadow(width, height);
+        tiles.clear(width, height);
+        fetch_rect(win, full, tiles);
+        tiles.mark_all(width, height);
+        return shadow;
+    }
+
+    tiles.clear(width, height);
+
+    // clip the rectangles to the area, reading a rectangle costs a
+    // round trip to the server so with many small ones read their
+    // bounding box at once
+    int x1 = width, y1 = height, x2 = 0, y2 = 0;
+    std::vector<XRectangle> clipped;
+    clipped.reserve(rects.size());
+    for (const auto &rect : rects) {
+        int rx1 = std::max<int>(rect.x, 0), ry1 = std::max<int>(rect.y, 0);
+        int rx2 = std::min<int>(rect.x + rect.width, width);
+        int ry2 = std::min<int>(rect.y + rect.height, height);
+        if (rx1 >= rx2 || ry1 >= ry2) {
+            continue;
+        }
+        clipped.push_back({ (short) rx1, (short) ry1,
+                            (unsigned short) (rx2 - rx1), (unsigned short) (ry2 - ry1) });
+        x1 = std::min(x1, rx1);
+        y1 = std::min(y1, ry1);
+        x2 = std::max(x2, rx2);
+        y2 = std::max(y2, ry2);
+    }
+
+    if (clipped.size() > max_rects) {
+        fetch_rect(win, { (short) x1, (short) y1,
+                          (unsigned short) (x2 - x1), (unsigned short) (y2 - y1) }, tiles);
+    } else {
+        for (const auto &rect : clipped) {
+            fetch_rect(win, rect, tiles);
+        }
+    }
+
+    return shadow;
+}
+
+}} // namespace spice::streaming_agent
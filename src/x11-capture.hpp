@@ -0,0 +1,138 @@
+/* Screen grabbing from X11 using MIT-SHM when available.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+
+#include "frame-buffer.hpp"
+
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+class TileDiff;
+
+/*!
+ * Catches the X errors caused by the requests sent to a display during
+ * the life of the trap, which the default handler would report by
+ * exiting the process.
+ *
+ * A single error handler is installed for the whole process the first
+ * time a trap is created and stays installed. It matches the errors to
+ * the traps by display and request serial, so traps can be used from
+ * several threads on their own displays. Other errors go to the handler
+ * installed before.
+ */
+class XErrorTrap
+{
+public:
+    explicit XErrorTrap(Display *dpy);
+    ~XErrorTrap();
+    XErrorTrap(const XErrorTrap &) = delete;
+    XErrorTrap &operator=(const XErrorTrap &) = delete;
+
+    /*!
+     * Wait for the requests sent so far to be processed by the server
+     * and tell whether one of them failed.
+     */
+    bool failed();
+
+private:
+    static int handle_error(Display *dpy, XErrorEvent *event);
+
+    Display *const dpy;
+    // serial of the first request covered by the trap
+    const unsigned long first_serial;
+    // set by handle_error, protected by the mutex of the traps
+    bool error = false;
+};
+
+/*!
+ * Create an image in a new MIT-SHM segment attached to the X server, to
+ * be read with XShmGetImage. The segment is already marked for removal,
+ * it disappears once both the server and the client detach from it.
+ * \return the image, or nullptr if it cannot be created
+ */
+XImage *create_shm_image(Display *dpy, XShmSegmentInfo &shminfo, unsigned width, unsigned height);
+
+/*!
+ * Grabs the content of a window into an XImage.
+ *
+ * When the X server supports the MIT-SHM extension, the image is read with
+ * XShmGetImage into one of two preallocated shared memory segments, which
+ * are only reallocated when the size of the grabbed area changes. When SHM
+ * cannot be used (remote display, missing extension, failure to attach)
+ * the capture falls back to XGetImage.
+ *
+ * The two images are used alternately, so the image returned by a call to
+ * grab() stays valid until grab() is called twice more. This allows
+ * comparing a frame with the previous one.
+ *
+ * Alternatively, when the changed areas of the window are known, update()
+ * maintains a shadow copy of the window reading only these areas.
+ */
+class X11Capture
+{
+public:
+    X11Capture(Display *dpy);
+    ~X11Capture();
+    X11Capture(const X11Capture &) = delete;
+    X11Capture &operator=(const X11Capture &) = delete;
+
+    /*!
+     * Grab the area (0, 0, width, height) of the window.
+     * Throws an Error if the image cannot be read.
+     */
+    XImage *grab(Window win, unsigned width, unsigned height);
+
+    /*!
+     * Update the shadow copy of the area (0, 0, width, height) of the
+     * window reading only the given rectangles, and return it.
+     * The whole area is read when its size changed.
+     * The tiles whose content actually changed are recorded in tiles.
+     * Throws an Error if the image cannot be read.
+     */
+    XImage *update(Window win, unsigned width, unsigned height,
+                   const std::vector<XRectangle> &rects, TileDiff &tiles);
+
+    bool using_shm() const
+    {
+        return use_shm;
+    }
+
+private:
+    struct Buffer
+    {
+        XImage *image = nullptr;
+        XShmSegmentInfo shminfo{};
+    };
+
+    bool alloc_shm_buffer(Buffer &buffer, unsigned width, unsigned height);
+    void free_buffer(Buffer &buffer);
+    void disable_shm();
+    void alloc_shadow(unsigned width, unsigned height);
+    void fetch_rect(Window win, const XRectangle &rect, TileDiff &tiles);
+
+    // above this number of rectangles their bounding box is read at once
+    static constexpr size_t max_rects = 32;
+
+    Display *const dpy;
+    bool use_shm;
+    Buffer buffers[2];
+    unsigned current = 0;
+    // buffer where the rectangles are read by update() before being
+    // copied to the shadow image
+    Buffer scratch;
+    XImage *shadow = nullptr;
+    FrameBuffer shadow_data{true};
+};
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,92 @@
+/* Tracking of screen changes using the X11 DAMAGE extension.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "x11-damage.hpp"
+#include "utils.hpp"
+
+#include <spice-streaming-agent/error.hpp>
+
+
+
+namespace spice {
+namespace streaming_agent {
+
+DamageMonitor::DamageMonitor(X11Events &events, Display *dpy, Window win) :
+    events(events),
+    dpy(dpy)
+{
+    int error_base, major = 1, minor = 1;
+
+    if (!XDamageQueryExtension(dpy, &event_base, &error_base) ||
+        !XDamageQueryVersion(dpy, &major, &minor)) {
+        throw Error("X server does not support the DAMAGE extension");
+    }
+
+    int fixes_event_base, fixes_major = 2, fixes_minor = 0;
+    if (!XFixesQueryExtension(dpy, &fixes_event_base, &error_base) ||
+        !XFixesQueryVersion(dpy, &fixes_major, &fixes_minor) || fixes_major < 2) {
+        throw Error("X server does not support the XFIXES extension");
+    }
+    region = XFixesCreateRegion(dpy, nullptr, 0);
+
+    // report only the transition to a non-empty damage, the damage is
+    // cleared by reset() once the window has been read
+    damage = XDamageCreate(dpy, win, XDamageReportNonEmpty);
+    XFlush(dpy);
+
+    handler = events.add_handler([this](XEvent &event) {
+        if (event.type != event_base + XDamageNotify) {
+            return false;
+        }
+        damaged = true;
+        return true;
+    });
+}
+
+DamageMonitor::~DamageMonitor()
+{
+    events.remove_handler(handler);
+    XDamageDestroy(dpy, damage);
+    XFixesDestroyRegion(dpy, region);
+    XFlush(dpy);
+}
+
+bool DamageMonitor::wait(uint64_t timeout)
+{
+    const uint64_t deadline = utils::get_time() + timeout;
+
+    events.dispatch();
+    // other events can wake up the wait
+    while (!damaged) {
+        if (!events.wait_until(deadline)) {
+            return damaged;
+        }
+    }
+    return true;
+}
+
+void DamageMonitor::reset()
+{
+    XDamageSubtract(dpy, damage, None, None);
+    damaged = false;
+}
+
+std::vector<XRectangle> DamageMonitor::take_damage()
+{
+    XDamageSubtract(dpy, damage, None, region);
+    damaged = false;
+
+    int count = 0;
+    XRectangle *rects = XFixesFetchRegion(dpy, region, &count);
+    std::vector<XRectangle> result;
+    if (rects) {
+        result.assign(rects, rects + count);
+        XFree(rects);
+    }
+    return result;
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,69 @@
+/* Tracking of screen changes using the X11 DAMAGE extension.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xdamage.h>
+
+#include "x11-events.hpp"
+
+#include <cstdint>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Monitors the damage (changed areas) of a window.
+ *
+ * The events of the X connection are read through the X11Events given,
+ * so other monitors can share the connection.
+ */
+class DamageMonitor
+{
+public:
+    /*!
+     * Start monitoring the window.
+     * Throws an Error if the DAMAGE extension is not available.
+     */
+    DamageMonitor(X11Events &events, Display *dpy, Window win);
+    ~DamageMonitor();
+    DamageMonitor(const DamageMonitor &) = delete;
+    DamageMonitor &operator=(const DamageMonitor &) = delete;
+
+    /*!
+     * Wait for the window to be damaged since the last call to reset().
+     * \param timeout maximum time to wait in nanoseconds
+     * \return true if the window was damaged, false on timeout
+     */
+    bool wait(uint64_t timeout);
+
+    /*!
+     * Forget the damage accumulated so far.
+     * Should be called right before reading the window content so that
+     * changes happening while reading are reported again.
+     */
+    void reset();
+
+    /*!
+     * Like reset() but also return the rectangles damaged since the last
+     * reset.
+     */
+    std::vector<XRectangle> take_damage();
+
+private:
+    X11Events &events;
+    unsigned handler;
+    Display *const dpy;
+    Damage damage = None;
+    XserverRegion region = None;
+    int event_base = 0;
+    bool damaged = true;
+};
+
+}} // namespace spice::streaming_agent
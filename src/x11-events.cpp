@@ -0,0 +1,69 @@
+/* Dispatch of the events of an X11 connection.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "x11-events.hpp"
+#include "utils.hpp"
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <errno.h>
+#include <poll.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+unsigned X11Events::add_handler(const Handler &handler)
+{
+    handlers[next_id] = handler;
+    return next_id++;
+}
+
+void X11Events::remove_handler(unsigned id)
+{
+    handlers.erase(id);
+}
+
+bool X11Events::dispatch()
+{
+    bool wake = false;
+
+    while (XPending(dpy)) {
+        XEvent event;
+        XNextEvent(dpy, &event);
+
+        bool has_data = event.type == GenericEvent && XGetEventData(dpy, &event.xcookie);
+        for (auto &handler : handlers) {
+            wake = handler.second(event) || wake;
+        }
+        if (has_data) {
+            XFreeEventData(dpy, &event.xcookie);
+        }
+    }
+    return wake;
+}
+
+bool X11Events::wait_until(uint64_t deadline)
+{
+    for (;;) {
+        if (dispatch()) {
+            return true;
+        }
+
+        uint64_t now = utils::get_time();
+        if (now >= deadline) {
+            return false;
+        }
+
+        int timeout_ms = (deadline - now + 999999) / 1000000;
+        struct pollfd pollfd = {ConnectionNumber(dpy), POLLIN, 0};
+        if (poll(&pollfd, 1, timeout_ms) < 0 && errno != EINTR) {
+            throw Error("poll failed on the X connection");
+        }
+    }
+}
+
+}} // namespace spice::streaming_agent
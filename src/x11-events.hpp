@@ -0,0 +1,62 @@
+/* Dispatch of the events of an X11 connection.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <X11/Xlib.h>
+
+#include <cstdint>
+#include <functional>
+#include <map>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Reads the events of an X connection for several monitors, passing each
+ * event to all their handlers.
+ *
+ * The data of the generic events (XGenericEventCookie) is already
+ * retrieved when the handlers are called. The connection must not be
+ * used concurrently by other threads.
+ */
+class X11Events
+{
+public:
+    /*! Returns true if the event should make wait_until() return */
+    typedef std::function<bool(XEvent &event)> Handler;
+
+    explicit X11Events(Display *dpy): dpy(dpy)
+    {
+    }
+    X11Events(const X11Events &) = delete;
+    X11Events &operator=(const X11Events &) = delete;
+
+    /*! \return an identifier of the handler for remove_handler() */
+    unsigned add_handler(const Handler &handler);
+    void remove_handler(unsigned id);
+
+    /*!
+     * Handle the events already received.
+     * \return whether a handler asked to wake up
+     */
+    bool dispatch();
+
+    /*!
+     * Handle the events until a handler asks to wake up or the deadline
+     * (in ns on CLOCK_MONOTONIC) is reached.
+     * \return whether a handler asked to wake up
+     */
+    bool wait_until(uint64_t deadline);
+
+private:
+    Display *const dpy;
+    std::map<unsigned, Handler> handlers;
+    unsigned next_id = 0;
+};
+
+}} // namespace spice::streaming_agent
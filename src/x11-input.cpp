@@ -0,0 +1,72 @@
+/* Monitoring of the user input with the XInput 2 extension.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "x11-input.hpp"
+#include "utils.hpp"
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <X11/extensions/XInput2.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+static void select_raw_events(Display *dpy, Window root, bool input)
+{
+    unsigned char bits[XIMaskLen(XI_LASTEVENT)] = {};
+    if (input) {
+        XISetMask(bits, XI_RawKeyPress);
+        XISetMask(bits, XI_RawButtonPress);
+        XISetMask(bits, XI_RawMotion);
+    }
+
+    XIEventMask mask;
+    mask.deviceid = XIAllMasterDevices;
+    mask.mask_len = sizeof(bits);
+    mask.mask = bits;
+    XISelectEvents(dpy, root, &mask, 1);
+    XFlush(dpy);
+}
+
+InputMonitor::InputMonitor(X11Events &events, Display *dpy, Window root) :
+    events(events),
+    dpy(dpy),
+    root(root)
+{
+    int event_base, error_base;
+    if (!XQueryExtension(dpy, "XInputExtension", &opcode, &event_base, &error_base)) {
+        throw Error("XInput extension not available");
+    }
+
+    // the raw events are delivered to the root window since XInput 2.0,
+    // but only since 2.1 while another client grabs the devices
+    int major = 2, minor = 1;
+    if (XIQueryVersion(dpy, &major, &minor) != Success) {
+        throw Error("XInput 2 not available");
+    }
+    if (major == 2 && minor < 1) {
+        throw Error("XInput 2.1 not available");
+    }
+
+    select_raw_events(dpy, root, true);
+
+    handler = events.add_handler([this](XEvent &event) {
+        if (event.xcookie.type != GenericEvent || event.xcookie.extension != opcode) {
+            return false;
+        }
+        last = utils::get_time();
+        return true;
+    });
+}
+
+InputMonitor::~InputMonitor()
+{
+    events.remove_handler(handler);
+    select_raw_events(dpy, root, false);
+}
+
+}} // namespace spice::streaming_agent
@@ -0,0 +1,48 @@
+/* Monitoring of the user input with the XInput 2 extension.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include "x11-events.hpp"
+
+#include <X11/Xlib.h>
+
+#include <cstdint>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Records when the user last pressed a key or a button or moved the
+ * pointer, using the raw events of XInput 2 which are delivered whatever
+ * window has the focus or grabs the devices.
+ */
+class InputMonitor
+{
+public:
+    /*! Throws an Error if the XInput extension 2.1 is not available */
+    InputMonitor(X11Events &events, Display *dpy, Window root);
+    ~InputMonitor();
+    InputMonitor(const InputMonitor &) = delete;
+    InputMonitor &operator=(const InputMonitor &) = delete;
+
+    /*! Time of the last input in ns on CLOCK_MONOTONIC, 0 if none yet */
+    uint64_t last_input() const
+    {
+        return last;
+    }
+
+private:
+    X11Events &events;
+    unsigned handler;
+    Display *const dpy;
+    Window root;
+    int opcode;
+    uint64_t last = 0;
+};
+
+}} // namespace spice::streaming_agent
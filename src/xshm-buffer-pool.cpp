@@ -0,0 +1,178 @@
+/* GStreamer buffer pool of MIT-SHM images.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#include "xshm-buffer-pool.hpp"
+#include "x11-capture.hpp"
+
+#include <spice-streaming-agent/error.hpp>
+
+#include <sys/shm.h>
+
+
+namespace spice {
+namespace streaming_agent {
+
+XShmReleasedSegments::XShmReleasedSegments(Display *dpy) :
+    dpy(dpy)
+{
+}
+
+void XShmReleasedSegments::add(ShmSeg segment)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    segments.push_back(segment);
+}
+
+void XShmReleasedSegments::collect()
+{
+    std::vector<ShmSeg> detached;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        detached.swap(segments);
+    }
+
+    for (ShmSeg segment : detached) {
+        XShmSegmentInfo shminfo{};
+        shminfo.shmseg = segment;
+        XShmDetach(dpy, &shminfo);
+    }
+}
+
+namespace {
+
+struct Segment
+{
+    XImage *image;
+    XShmSegmentInfo shminfo;
+    std::shared_ptr<XShmReleasedSegments> released;
+};
+
+/* Called when the memory of a buffer is freed, from any thread */
+void free_segment(gpointer data)
+{
+    Segment *segment = static_cast<Segment *>(data);
+
+    shmdt(segment->shminfo.shmaddr);
+    segment->image->data = nullptr;
+    // only frees the structure, it does not use the display
+    XDestroyImage(segment->image);
+    segment->released->add(segment->shminfo.shmseg);
+    delete segment;
+}
+
+GQuark image_quark()
+{
+    static GQuark quark = g_quark_from_static_string("spice-streaming-agent-ximage");
+    return quark;
+}
+
+struct ShmPool
+{
+    GstBufferPool parent;
+    Display *dpy;
+    unsigned width, height;
+    std::shared_ptr<XShmReleasedSegments> *released;
+};
+
+struct ShmPoolClass
+{
+    GstBufferPoolClass parent_class;
+};
+
+G_DEFINE_TYPE(ShmPool, shm_pool, GST_TYPE_BUFFER_POOL)
+
+/* Allocate a buffer, from the thread calling acquire() */
+GstFlowReturn shm_pool_alloc_buffer(GstBufferPool *pool, GstBuffer **buffer,
+                                    GstBufferPoolAcquireParams *params)
+{
+    ShmPool *self = reinterpret_cast<ShmPool *>(pool);
+
+    std::unique_ptr<Segment> segment(new Segment);
+    segment->image = create_shm_image(self->dpy, segment->shminfo, self->width, self->height);
+    if (!segment->image) {
+        return GST_FLOW_ERROR;
+    }
+    segment->released = *self->released;
+
+    XImage *image = segment->image;
+    const gsize size = image->bytes_per_line * image->height;
+    *buffer = gst_buffer_new();
+    gst_buffer_append_memory(*buffer, gst_memory_new_wrapped(GstMemoryFlags(0), image->data, size,
+                                                             0, size, segment.release(),
+                                                             free_segment));
+    gst_mini_object_set_qdata(GST_MINI_OBJECT(*buffer), image_quark(), image, nullptr);
+    return GST_FLOW_OK;
+}
+
+void shm_pool_finalize(GObject *object)
+{
+    ShmPool *self = reinterpret_cast<ShmPool *>(object);
+
+    delete self->released;
+    G_OBJECT_CLASS(shm_pool_parent_class)->finalize(object);
+}
+
+void shm_pool_class_init(ShmPoolClass *klass)
+{
+    G_OBJECT_CLASS(klass)->finalize = shm_pool_finalize;
+    GST_BUFFER_POOL_CLASS(klass)->alloc_buffer = shm_pool_alloc_buffer;
+}
+
+void shm_pool_init(ShmPool *self)
+{
+    self->dpy = nullptr;
+    self->width = self->height = 0;
+    self->released = nullptr;
+}
+
+}
+
+XShmBufferPool::XShmBufferPool(Display *dpy, const std::shared_ptr<XShmReleasedSegments> &released,
+                               GstCaps *caps, unsigned width, unsigned height) :
+    released(released)
+{
+    if (!XShmQueryExtension(dpy)) {
+        throw Error("MIT-SHM extension not available");
+    }
+
+    ShmPool *shm_pool = static_cast<ShmPool *>(g_object_new(shm_pool_get_type(), nullptr));
+    shm_pool->dpy = dpy;
+    shm_pool->width = width;
+    shm_pool->height = height;
+    shm_pool->released = new std::shared_ptr<XShmReleasedSegments>(released);
+    pool = GST_BUFFER_POOL(shm_pool);
+
+    // one buffer being captured, one being encoded
+    GstStructure *config = gst_buffer_pool_get_config(pool);
+    gst_buffer_pool_config_set_params(config, caps, width * height * 4, 2, 0);
+    if (!gst_buffer_pool_set_config(pool, config) || !gst_buffer_pool_set_active(pool, TRUE)) {
+        gst_object_unref(pool);
+        released->collect();
+        throw Error("Cannot allocate the MIT-SHM capture buffers");
+    }
+}
+
+XShmBufferPool::~XShmBufferPool()
+{
+    // the buffers still in the pipeline are freed when it releases them,
+    // their segments are detached by the next collect() of released
+    gst_buffer_pool_set_active(pool, FALSE);
+    gst_object_unref(pool);
+    released->collect();
+}
+
+GstBuffer *XShmBufferPool::acquire(XImage *&image)
+{
+    GstBuffer *buffer = nullptr;
+    if (gst_buffer_pool_acquire_buffer(pool, &buffer, nullptr) != GST_FLOW_OK || !buffer) {
+        throw Error("Cannot allocate a MIT-SHM capture buffer");
+    }
+    image = static_cast<XImage *>(gst_mini_object_get_qdata(GST_MINI_OBJECT(buffer),
+                                                             image_quark()));
+    return buffer;
+}
+
+}} // namespace spice::streaming_agent
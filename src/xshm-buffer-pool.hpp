@@ -0,0 +1,79 @@
+/* GStreamer buffer pool of MIT-SHM images.
+ *
+ * \copyright
+ * Copyright 2019 Red Hat Inc. All rights reserved.
+ */
+
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <gst/gst.h>
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace spice {
+namespace streaming_agent {
+
+/*!
+ * Segments of the freed buffers of the pools, still attached to the X
+ * server.
+ *
+ * The buffers can be released by any thread of the pipeline while the X
+ * connection is only used by the capture thread, so the segments are
+ * detached by collect(). The list outlives the pools, so the buffers
+ * still in the pipeline when their pool is replaced are detached too.
+ */
+class XShmReleasedSegments
+{
+public:
+    explicit XShmReleasedSegments(Display *dpy);
+
+    /*! Record the segment of a freed buffer, from any thread */
+    void add(ShmSeg segment);
+    /*! Detach the segments recorded, from the thread using the display */
+    void collect();
+
+private:
+    Display *const dpy;
+    std::mutex mutex;
+    std::vector<ShmSeg> segments;
+};
+
+/*!
+ * Pool of GStreamer buffers whose memory is an image in a MIT-SHM segment,
+ * so the screen can be read with XShmGetImage directly into the buffers
+ * pushed to the pipeline. The buffers go back to the pool once the
+ * pipeline releases them.
+ *
+ * The segments of the freed buffers are recorded in released, whose
+ * collect() must be called regularly.
+ */
+class XShmBufferPool
+{
+public:
+    /*!
+     * Create and activate a pool of images of the given size.
+     * Throws an Error if the MIT-SHM segments cannot be used.
+     */
+    XShmBufferPool(Display *dpy, const std::shared_ptr<XShmReleasedSegments> &released,
+                   GstCaps *caps, unsigned width, unsigned height);
+    ~XShmBufferPool();
+    XShmBufferPool(const XShmBufferPool &) = delete;
+    XShmBufferPool &operator=(const XShmBufferPool &) = delete;
+
+    /*!
+     * Get a free buffer and the image it holds.
+     * Throws an Error if no buffer can be allocated.
+     */
+    GstBuffer *acquire(XImage *&image);
+
+private:
+    GstBufferPool *pool;
+    std::shared_ptr<XShmReleasedSegments> released;
+};
+
+}} // namespace spice::streaming_agent